@@ -2,18 +2,43 @@
 
 #ln -s /usr/lib/aarch64-linux-gnu/libi2c.so.0 /usr/lib/aarch64-linux-gnu/libi2c.so
 
-if [ -f "RTCSyncTool" ]; then
-echo "Removing compiled RTCSyncTool..."
-rm -r RTCSyncTool
+# ./buildRTCSyncTool.sh [full|boot-isl1208|boot-bq32k]
+# The boot variants only do hctosys for one chip, for the initramfs.
+VARIANT="${1:-full}"
+BOOT_FLAGS="-Os -ffunction-sections -fdata-sections -Wl,--gc-sections -DRTC_BOOT_MINIMAL=1 -DRTC_WITH_SYSFS_BIND=0 -DRTC_WITH_MUX=0"
+
+case "$VARIANT" in
+full)
+    OUTPUT="RTCSyncTool"
+    FLAGS=""
+    ;;
+boot-isl1208)
+    OUTPUT="RTCSyncTool-boot-isl1208"
+    FLAGS="$BOOT_FLAGS -DRTC_WITH_BQ32K=0"
+    ;;
+boot-bq32k)
+    OUTPUT="RTCSyncTool-boot-bq32k"
+    FLAGS="$BOOT_FLAGS -DRTC_WITH_ISL1208=0"
+    ;;
+*)
+    echo "Unknown variant $VARIANT, use full, boot-isl1208 or boot-bq32k"
+    exit 1
+    ;;
+esac
+
+if [ -f "$OUTPUT" ]; then
+echo "Removing compiled $OUTPUT..."
+rm -r "$OUTPUT"
 fi
 
-echo "Compiling RTCSyncTool..."
+echo "Compiling $OUTPUT..."
 #ldconfig
 
-#LD_LIBRARY_PATH="$LD_LIBRARY_PATH:/usr/lib/aarch64-linux-gnu/" gcc -static -o RTCSyncTool rtcsynctool.c -li2c -lc
-gcc -static -o RTCSyncTool rtcsynctool.c -li2c -lc
+#LD_LIBRARY_PATH="$LD_LIBRARY_PATH:/usr/lib/aarch64-linux-gnu/" gcc -static -o RTCSyncTool rtcsynctool.c -lrt -lm -lc
+gcc -static $FLAGS $CFLAGS -o "$OUTPUT" rtcsynctool.c -lrt -lm -lc
 
-if [ -f "RTCSyncTool" ]; then
-echo "RTCSyncTool compiled successfully, stripping binary..."
-strip RTCSyncTool
+if [ -f "$OUTPUT" ]; then
+echo "$OUTPUT compiled successfully, stripping binary..."
+strip "$OUTPUT"
+echo "$OUTPUT: $(stat -c %s "$OUTPUT") bytes"
 fi
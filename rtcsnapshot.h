@@ -0,0 +1,115 @@
+#ifndef RTCSNAPSHOT_H
+#define RTCSNAPSHOT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ Header-only reader for the RTC snapshot page published by "RTCSyncTool publish".
+
+ The page lives in POSIX shared memory and is guarded by a seqlock, a reader never
+ makes a syscall or touches the i2c bus after rtc_snapshot_open():
+
+    struct rtc_snapshot_page *page = rtc_snapshot_open();
+    struct rtc_snapshot snap;
+    if (page && rtc_snapshot_read(page, &snap) == 0){
+        printf("RTC offset: %lld ns\n", (long long)snap.offsetNsec);
+    }
+    rtc_snapshot_close(page);
+*/
+
+#define RTC_SNAPSHOT_SHM_NAME "/rtcsynctool"
+#define RTC_SNAPSHOT_MAGIC 0x52544353   // 'RTCS'
+#define RTC_SNAPSHOT_VERSION 1
+#define RTC_SNAPSHOT_MAX_REGS 16
+#define RTC_SNAPSHOT_MAX_TRIES 100000   // a writer that died mid-update leaves seq odd for good
+
+struct rtc_snapshot {
+    uint8_t chip;           // i2c address of the RTC (0x68 BQ32K, 0x6f ISL1208)
+    uint8_t oscRunning;     // 1 if the oscillator was running when sampled
+    uint8_t regCount;       // number of valid bytes in regs[]
+    uint8_t reserved;
+    uint8_t regs[RTC_SNAPSHOT_MAX_REGS]; // raw registers, starting at 0x00
+
+    int32_t year;
+    int32_t month;
+    int32_t day;
+    int32_t hours;
+    int32_t minutes;
+    int32_t seconds;
+    int32_t weekday;        // as stored in the RTC
+
+    int64_t rtcEpoch;       // decoded RTC time in seconds since the epoch
+    int64_t sampleSec;      // CLOCK_REALTIME at the middle of the bus read
+    int32_t sampleNsec;
+    int32_t readCostNsec;   // how long the bus read took
+    int64_t offsetNsec;     // RTC minus system time, the RTC only has 1s resolution
+};
+
+struct rtc_snapshot_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;           // seqlock counter, odd while the writer is busy
+    uint32_t reserved;
+    struct rtc_snapshot snap;
+};
+
+static inline struct rtc_snapshot_page *rtc_snapshot_open(void){
+    int fd = shm_open(RTC_SNAPSHOT_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0){
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct rtc_snapshot_page)){
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, sizeof(struct rtc_snapshot_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        return NULL;
+    }
+
+    struct rtc_snapshot_page *page = (struct rtc_snapshot_page *)map;
+    if (page->magic != RTC_SNAPSHOT_MAGIC || page->version != RTC_SNAPSHOT_VERSION){
+        munmap(map, sizeof(struct rtc_snapshot_page));
+        return NULL;
+    }
+    return page;
+}
+
+// Returns 0 with a consistent copy in *out, -1 if nothing was published yet, -2 if no consistent copy could be
+// taken (the writer is stuck or died mid-update).
+static inline int rtc_snapshot_read(const struct rtc_snapshot_page *page, struct rtc_snapshot *out){
+    uint32_t before;
+    uint32_t after;
+    int tries;
+
+    for (tries = 0; tries < RTC_SNAPSHOT_MAX_TRIES; tries++){
+        before = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (before & 1){
+            continue;
+        }
+        memcpy(out, (const void *)&page->snap, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+        if (before == after){
+            return before == 0 ? -1 : 0;
+        }
+    }
+    return -2;
+}
+
+static inline void rtc_snapshot_close(struct rtc_snapshot_page *page){
+    if (page){
+        munmap((void *)page, sizeof(struct rtc_snapshot_page));
+    }
+}
+
+#endif
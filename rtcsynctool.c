@@ -11,6 +11,100 @@
 #include <time.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/timex.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/file.h>
+#include <syslog.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+
+#include "rtcsnapshot.h"
+
+// Build-time feature selection, everything is in unless switched off (buildRTCSyncTool.sh has the variants).
+// RTC_BOOT_MINIMAL is the initramfs build: hctosys only, no daemons or drift log. It decodes the RTC as local time
+// like the full build, so both set the same system time.
+#ifndef RTC_WITH_ISL1208
+#define RTC_WITH_ISL1208 1
+#endif
+#ifndef RTC_WITH_BQ32K
+#define RTC_WITH_BQ32K 1
+#endif
+#ifndef RTC_WITH_SYSFS_BIND
+#define RTC_WITH_SYSFS_BIND 1   // force: unbind/rebind the kernel RTC driver
+#endif
+#ifndef RTC_WITH_MUX
+#define RTC_WITH_MUX 1          // mux=
+#endif
+#ifndef RTC_BOOT_MINIMAL
+#define RTC_BOOT_MINIMAL 0
+#endif
+
+#if RTC_BOOT_MINIMAL
+#undef RTC_WITH_DRIFT_LOG
+#undef RTC_WITH_DAEMONS
+#undef RTC_WITH_TRACE
+#define RTC_WITH_DRIFT_LOG 0
+#define RTC_WITH_DAEMONS 0
+#define RTC_WITH_TRACE 0
+#endif
+#ifndef RTC_WITH_DRIFT_LOG
+#define RTC_WITH_DRIFT_LOG 1    // drift.log samples and the drift model behind hctosys
+#endif
+#ifndef RTC_WITH_DAEMONS
+#define RTC_WITH_DAEMONS 1      // publish, refclock, steer, steersim and the shared snapshot page
+#endif
+#ifndef RTC_WITH_TRACE
+#define RTC_WITH_TRACE 1        // record= and replay= of the i2c transactions
+#endif
+
+#if !RTC_WITH_ISL1208 && !RTC_WITH_BQ32K
+#error "No RTC chip selected, build with RTC_WITH_ISL1208 and/or RTC_WITH_BQ32K"
+#endif
+
+// Static USDT probes (provider "rtcsynctool") for perf/bpftrace, built in when <sys/sdt.h> is available
+// (systemtap-sdt-dev). Every probe has a semaphore, so the timing for the *_done probes is only taken
+// while a tracer is attached. Without sdt.h the probes compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define RTC_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef RTC_HAVE_SDT
+#define RTC_PROBE_SEMAPHORE(name) __extension__ unsigned short rtcsynctool_##name##_semaphore __attribute__((unused, section(".probes")))
+#define RTC_PROBE_ENABLED(name) __builtin_expect(rtcsynctool_##name##_semaphore != 0, 0)
+#define RTC_PROBE1(name, a) STAP_PROBE1(rtcsynctool, name, a)
+#define RTC_PROBE2(name, a, b) STAP_PROBE2(rtcsynctool, name, a, b)
+#define RTC_PROBE3(name, a, b, c) STAP_PROBE3(rtcsynctool, name, a, b, c)
+#define RTC_PROBE4(name, a, b, c, d) STAP_PROBE4(rtcsynctool, name, a, b, c, d)
+#define RTC_PROBE5(name, a, b, c, d, e) STAP_PROBE5(rtcsynctool, name, a, b, c, d, e)
+#else
+#define RTC_PROBE_SEMAPHORE(name) extern int rtcsynctool_##name##_semaphore_unused
+#define RTC_PROBE_ENABLED(name) 0
+#define RTC_PROBE1(name, a) do { (void)(a); } while (0)
+#define RTC_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define RTC_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#define RTC_PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#define RTC_PROBE5(name, a, b, c, d, e) do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } while (0)
+#endif
+
+RTC_PROBE_SEMAPHORE(bus_open_start);     // bus
+RTC_PROBE_SEMAPHORE(bus_open_done);      // bus, errno, ns
+RTC_PROBE_SEMAPHORE(probe_start);        // chip
+RTC_PROBE_SEMAPHORE(probe_done);         // chip, found (0 = yes), ns
+RTC_PROBE_SEMAPHORE(i2c_xfer_start);     // chip, register (-1 if none), length, write
+RTC_PROBE_SEMAPHORE(i2c_xfer_done);      // chip, register, length, errno, ns
+RTC_PROBE_SEMAPHORE(sysfs_bind_start);   // device, driver, bind (0 = unbind)
+RTC_PROBE_SEMAPHORE(sysfs_bind_done);    // device, driver, bind, errno, ns
+RTC_PROBE_SEMAPHORE(settime_start);      // seconds, microseconds
+RTC_PROBE_SEMAPHORE(settime_done);       // errno, ns
 
 /*
  Changelog:
@@ -21,6 +115,19 @@
  version 0.5 -> Improve error messages, improve output and improved bind/unbind logic & filepaths.
  version 0.6 -> Add force command for the systohc and hctosys commands
  version 0.7 -> Fixed 12/24h representation according to the ISL1208 datasheet
+ version 0.8 -> Added publish command, long-running mode that shares the latest RTC snapshot through shared memory (see rtcsnapshot.h)
+ version 0.9 -> Negotiate the transfer strategy from I2C_FUNCS (I2C_RDWR burst, SMBus block or SMBus byte), burst read/write the time registers, report bus cost
+ version 1.0 -> Record RTC offsets with the board temperature, fit a thermal drift model and correct hctosys for drift since the last systohc
+ version 1.1 -> Keep a checksummed sync record (last systohc, drift) in the ISL1208 alarm/SRAM registers, so hctosys corrects drift without the filesystem
+ version 1.2 -> Added bus= and mux= options, reach the RTC behind a PCA954x mux without the kernel mux driver
+ version 1.3 -> Added refclock command, feeds RTC samples with rollover phase estimation to chrony/ntpd through the NTP SHM segment
+ version 1.4 -> Added USDT probes on bus open, probe, i2c transfers, sysfs bind/unbind and settimeofday
+ version 1.5 -> Serialize instances with a per-bus flock, a get waiting on another read shares its result
+ version 1.6 -> Added steer command, PI loop on the kernel frequency that holds the system clock on the RTC while NTP is away, and steersim to check it
+ version 1.7 -> Build-time selection of chips and features (RTC_WITH_*), RTC_BOOT_MINIMAL hctosys-only build for the initramfs
+ version 1.8 -> force only rebinds the driver name that was unbound, in a detached child after the result is out, also on failure
+ version 1.9 -> Added record= and replay= options, binary trace of every i2c register transaction with result and timing
+ version 2.0 -> Added watch command, sleeps on a TFD_TIMER_CANCEL_ON_SET timerfd and writes the RTC on the next second after a clock step
 */
 
 const uint8_t BQ32K = 0x68;
@@ -28,19 +135,42 @@ const uint8_t ISL1208 = 0x6f;
 const int CMD_ACTION_GET = 0;
 const int CMD_ACTION_SYSTOHC = 1;
 const int CMD_ACTION_HCTOSYS = 2;
+const int CMD_ACTION_PUBLISH = 3;
+const int CMD_ACTION_REFCLOCK = 4;
+const int CMD_ACTION_STEER = 5;
+const int CMD_ACTION_WATCH = 6;
 
+#if RTC_WITH_DAEMONS
+static volatile sig_atomic_t keepRunning = 1;
+#endif
+
+int64_t timespecToNs(const struct timespec *ts){
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// Monotonic clock for the probe and rebind timings.
+int64_t probeClockNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespecToNs(&now);
+}
+
+#if RTC_WITH_SYSFS_BIND
+// Unbuffered, the kernel's answer to a bind/unbind (ENODEV, EBUSY, a failed probe) comes back from write().
 int write_sysfs(const char *path, const char *value) {
-    FILE *f = fopen(path, "w");
-    if (!f) {
-        //perror("ERR: FOPEN FAILED\n");
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        //perror("ERR: OPEN FAILED\n");
         return -1;
     }
-    if (fprintf(f, "%s", value) < 0) {
-        //perror("ERR: FPRINTF FAILED\n");
-        fclose(f);
+    size_t len = strlen(value);
+    ssize_t written = write(fd, value, len);
+    int err = errno;
+    close(fd);
+    if (written != (ssize_t)len) {
+        errno = written < 0 ? err : EIO;
         return -1;
     }
-    fclose(f);
     return 0;
 }
 
@@ -48,15 +178,26 @@ int write_sysfs(const char *path, const char *value) {
 int unbind_device(const char *device, const char *driver) {
     char path[256];
     snprintf(path, sizeof(path), "/sys/bus/i2c/drivers/%s/unbind", driver);
-    return write_sysfs(path, device);
+
+    RTC_PROBE3(sysfs_bind_start, device, driver, 0);
+    int64_t start = RTC_PROBE_ENABLED(sysfs_bind_done) ? probeClockNs() : 0;
+    int res = write_sysfs(path, device);
+    RTC_PROBE5(sysfs_bind_done, device, driver, 0, res < 0 ? errno : 0, RTC_PROBE_ENABLED(sysfs_bind_done) ? probeClockNs() - start : 0);
+    return res;
 }
 
 // Function to bind a device driver
 int bind_device(const char *device, const char *driver) {
     char path[256];
     snprintf(path, sizeof(path), "/sys/bus/i2c/drivers/%s/bind", driver);
-    return write_sysfs(path, device);
+
+    RTC_PROBE3(sysfs_bind_start, device, driver, 1);
+    int64_t start = RTC_PROBE_ENABLED(sysfs_bind_done) ? probeClockNs() : 0;
+    int res = write_sysfs(path, device);
+    RTC_PROBE5(sysfs_bind_done, device, driver, 1, res < 0 ? errno : 0, RTC_PROBE_ENABLED(sysfs_bind_done) ? probeClockNs() - start : 0);
+    return res;
 }
+#endif
 
 void rootCheck(){
     uid_t uid = getuid();
@@ -66,80 +207,351 @@ void rootCheck(){
     }
 }
 
-void unbindDevices(uint8_t addr){
-    int res = 0;
-    if (addr == BQ32K){
-        res = unbind_device("0-0068", "bq32k");
-        if (res != 0){
-            res = unbind_device("0-0068", "rtc-bq32k");
-        }
+const int I2C_XFER_RDWR = 0;        // combined I2C_RDWR burst, needs I2C_FUNC_I2C
+const int I2C_XFER_SMBUS_BLOCK = 1; // SMBus I2C block read/write
+const int I2C_XFER_SMBUS_BYTE = 2;  // SMBus byte data, block reads repeated until stable
+
+int i2cXferMode = 0;
+int i2cSlaveAddr = -1;      // address currently bound with I2C_SLAVE, for the SMBus paths
+int64_t lastReadCostNs = 0; // duration of the last block read
+int i2cBus = 0;             // /dev/i2c-N
+
+// PCA954x mux in front of the RTC, used when the kernel mux driver is not loaded.
+#if RTC_WITH_MUX
+int muxAddr = -1;           // mux address, -1 when the RTC sits directly on the bus
+#else
+const int muxAddr = -1;     // compiled out, lets the compiler drop every mux path
+#endif
+int muxChannel = 0;
+bool muxEncoded = false;    // PCA9540/9542/9544 select with 0x04 | channel, the others with a bit per channel
+bool muxCombine = false;    // adapter can STOP between messages of one I2C_RDWR
+int muxSelected = -1;       // control byte currently in the mux, -1 if unknown
+int muxSaved = -1;          // control byte found at startup, restored on exit
+
+#if RTC_WITH_MUX
+// Parts mux= knows, without a model the mux is taken as an 8 channel PCA9548.
+struct muxModel {
+    const char *name;
+    bool encoded;
+    int channels;
+};
+
+const struct muxModel MUX_MODELS[] = {
+    { "pca9540", true, 2 },
+    { "pca9542", true, 2 },
+    { "pca9544", true, 4 },
+    { "pca9543", false, 2 },
+    { "pca9545", false, 4 },
+    { "pca9546", false, 4 },
+    { "pca9548", false, 8 },
+};
+
+// mux=ADDR:CHANNEL[:MODEL]
+int parseMuxOption(const char *arg){
+    char model[16] = "pca9548";
+    int channels = 0;
+    size_t i;
+
+    if (sscanf(arg, "%i:%i:%15s", &muxAddr, &muxChannel, model) < 2 || muxAddr < 0x03 || muxAddr > 0x77){
+        printf("ERR: BAD MUX, USE mux=0x70:2 OR mux=0x70:1:pca9542\n");
+        return -1;
     }
-    if (addr == ISL1208){
-        res = unbind_device("0-006f", "isl1208");
-        if (res != 0){
-            res = unbind_device("0-006f", "rtc-isl1208");
+
+    for (i = 0; i < sizeof(MUX_MODELS) / sizeof(MUX_MODELS[0]); i++){
+        if (strcmp(model, MUX_MODELS[i].name) == 0){
+            muxEncoded = MUX_MODELS[i].encoded;
+            channels = MUX_MODELS[i].channels;
         }
     }
+    if (channels == 0){
+        printf("ERR: UNKNOWN MUX %s, USE pca9540, pca9542, pca9543, pca9544, pca9545, pca9546 OR pca9548\n", model);
+        return -1;
+    }
+    if (muxChannel < 0 || muxChannel >= channels){
+        printf("ERR: %s HAS NO CHANNEL %d, USE 0 TO %d\n", model, muxChannel, channels - 1);
+        return -1;
+    }
+    return 0;
 }
+#endif
 
-void rebindDevices(uint8_t addr){
-    int res = 0;
-    if (addr == BQ32K){
-        res = bind_device("0-0068", "bq32k");
-        if (res != 0){
-            res = bind_device("0-0068", "rtc-bq32k");
-        }
-    }
+const char *i2cXferName(int mode){
+	if (mode == I2C_XFER_RDWR){
+		return "I2C_RDWR burst";
+	}
+	if (mode == I2C_XFER_SMBUS_BLOCK){
+		return "SMBus I2C block";
+	}
+	return "SMBus byte (read until stable)";
+}
 
-    if (addr == ISL1208){
-        res = bind_device("0-006f", "isl1208");
-        if (res != 0){
-            res = bind_device("0-006f", "rtc-isl1208");
-        }
-    }
+// Query the adapter once and pick the fastest transfer strategy it supports.
+int negotiateI2CAdapter(int fd)
+{
+	unsigned long funcs = 0;
+
+	if (ioctl(fd, I2C_FUNCS, &funcs) < 0) {
+		printf("ERR: %s:%s \n", __func__, strerror(errno));
+		return -1;
+	}
+
+	if (funcs & I2C_FUNC_I2C) {
+		i2cXferMode = I2C_XFER_RDWR;
+		muxCombine = (funcs & I2C_FUNC_PROTOCOL_MANGLING) != 0;
+	} else if ((funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK) && (funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+		i2cXferMode = I2C_XFER_SMBUS_BLOCK;
+	} else if ((funcs & I2C_FUNC_SMBUS_READ_BYTE_DATA) && (funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA)) {
+		i2cXferMode = I2C_XFER_SMBUS_BYTE;
+	} else {
+		printf("ERR: I2C ADAPTER SUPPORTS NO USABLE TRANSFER (FUNCS 0x%08lx)\n", funcs);
+		return -1;
+	}
+	return 0;
 }
 
-int probeI2CDevice(int fd, uint8_t addr, uint8_t forceUnbind){
-    if (ioctl(fd, I2C_SLAVE, addr) < 0) {
-        if (forceUnbind == 1){
-            //printf("Unbinding driver...\n");
-            unbindDevices(addr);
+// Every I2C_RDWR goes through here, so the transaction probes see all of them.
+int i2c_ioctl_rdwr(int fd, struct i2c_rdwr_ioctl_data *iocall)
+{
+	struct i2c_msg *last = &iocall->msgs[iocall->nmsgs - 1];
+	struct i2c_msg *first = last;
+	unsigned int i;
+
+	//A mux select can go in front, the probe describes the transaction with the device itself.
+	for (i = 0; i < iocall->nmsgs; i++) {
+		if (iocall->msgs[i].addr == last->addr) {
+			first = &iocall->msgs[i];
+			break;
+		}
+	}
+	int reg = ((first->flags & I2C_M_RD) || first->len == 0) ? -1 : first->buf[0];
+	int isWrite = (last->flags & I2C_M_RD) == 0;
 
-            if (ioctl(fd, I2C_SLAVE, addr) < 0) {
-                printf("ERR: FAILED TO TALK TO SLAVE 0x%02x AFTER UNBIND\n", addr);
-                return 1;
-            }else{
-                char buf[1];
-                if (read(fd, buf, 1) == 1) {
-                    //printf("Device found at address 0x%02x\n", addr);
-                    return 0;
-                } else {
-                    //printf("No device at address 0x%02x\n", addr);
-                    return 1;
-                }
-            }
-        }else{
-            printf("ERR: FAILED TO TALK TO SLAVE 0x%02x\n", addr);
-        }
-        return 1;
-    }
+	RTC_PROBE4(i2c_xfer_start, last->addr, reg, last->len, isWrite);
+	int64_t start = RTC_PROBE_ENABLED(i2c_xfer_done) ? probeClockNs() : 0;
+	int res = ioctl(fd, I2C_RDWR, (unsigned long) iocall);
+	int err = res < 0 ? errno : 0;
+	RTC_PROBE5(i2c_xfer_done, last->addr, reg, last->len, err, RTC_PROBE_ENABLED(i2c_xfer_done) ? probeClockNs() - start : 0);
 
-    char buf[1];
-    if (read(fd, buf, 1) == 1) {
-        //printf("Device found at address 0x%02x\n", addr);
-        return 0;
-    } else {
-        //printf("No device at address 0x%02x\n", addr);
-        return 1;
-    }
+	errno = err;
+	return res;
 }
 
-void printHelp(){
-    printf("\nRTCSyncTool usage:\nReading the RTC -> ./RTCSyncTool get\nSet system time from RTC -> ./RTCSyncTool hctosys\nSet RTC Time from System -> ./RTCSyncTool systohc\nTo force read the i2c device, just add 'force' to your command.\n");
+int i2c_smbus_access(int fd, char rw, uint8_t command, int size, union i2c_smbus_data *data)
+{
+	struct i2c_smbus_ioctl_data args;
+	int len = size == I2C_SMBUS_I2C_BLOCK_DATA ? data->block[0] : (size == I2C_SMBUS_BYTE_DATA ? 1 : 0);
+	int reg = size == I2C_SMBUS_BYTE ? -1 : command;
+
+	args.read_write = rw;
+	args.command = command;
+	args.size = size;
+	args.data = data;
+
+	RTC_PROBE4(i2c_xfer_start, i2cSlaveAddr, reg, len, rw == I2C_SMBUS_WRITE);
+	int64_t start = RTC_PROBE_ENABLED(i2c_xfer_done) ? probeClockNs() : 0;
+	int res = ioctl(fd, I2C_SMBUS, &args);
+	int err = res < 0 ? errno : 0;
+	RTC_PROBE5(i2c_xfer_done, i2cSlaveAddr, reg, len, err, RTC_PROBE_ENABLED(i2c_xfer_done) ? probeClockNs() - start : 0);
+
+	errno = err;
+	return res;
 }
 
-int i2c_reg_read_byte(int fd, uint8_t addr, uint8_t regaddr, uint8_t* content) 
+// SMBus transfers go to the I2C_SLAVE address of the fd, only switch it when it changes.
+int i2c_select_slave(int fd, uint8_t addr)
+{
+	if (i2cSlaveAddr == addr) {
+		return 0;
+	}
+	if (ioctl(fd, I2C_SLAVE, addr) < 0) {
+		return -1;
+	}
+	i2cSlaveAddr = addr;
+	return 0;
+}
+
+uint8_t muxControlByte(){
+	return muxEncoded ? (uint8_t)(0x04 | muxChannel) : (uint8_t)(1 << muxChannel);
+}
+
+int muxWrite(int fd, uint8_t ctrl)
+{
+	int res;
+
+	muxSelected = -1;
+	if (i2cXferMode == I2C_XFER_RDWR) {
+		struct i2c_rdwr_ioctl_data iocall;
+		struct i2c_msg i2c_msgs;
+
+		iocall.nmsgs = 1;
+		iocall.msgs = &i2c_msgs;
+
+		i2c_msgs.addr = muxAddr;
+		i2c_msgs.flags = 0; //write
+		i2c_msgs.buf = &ctrl;
+		i2c_msgs.len = 1;
+
+		res = i2c_ioctl_rdwr(fd, &iocall);
+	} else {
+		res = i2c_select_slave(fd, muxAddr);
+		if (res == 0) {
+			res = i2c_smbus_access(fd, I2C_SMBUS_WRITE, ctrl, I2C_SMBUS_BYTE, NULL);
+		}
+	}
+
+	if (res < 0) {
+		printf("ERR: %s:%s \n", __func__, strerror(errno));
+		return -1;
+	}
+	muxSelected = ctrl;
+	return 0;
+}
+
+// Switch to the RTC channel, nothing goes on the bus if it is already selected.
+int muxSelect(int fd)
+{
+	if (muxAddr < 0 || muxSelected == muxControlByte()) {
+		return 0;
+	}
+	return muxWrite(fd, muxControlByte());
+}
+
+// Remember what the mux was set to, so muxRestore() can put it back.
+int muxInit(int fd)
+{
+	int res;
+	uint8_t ctrl = 0;
+
+	if (muxAddr < 0) {
+		return 0;
+	}
+
+	if (i2cXferMode == I2C_XFER_RDWR) {
+		struct i2c_rdwr_ioctl_data iocall;
+		struct i2c_msg i2c_msgs;
+
+		iocall.nmsgs = 1;
+		iocall.msgs = &i2c_msgs;
+
+		i2c_msgs.addr = muxAddr;
+		i2c_msgs.flags = I2C_M_RD; //READ
+		i2c_msgs.buf = &ctrl;
+		i2c_msgs.len = 1;
+
+		res = i2c_ioctl_rdwr(fd, &iocall);
+	} else {
+		union i2c_smbus_data data;
+
+		res = i2c_select_slave(fd, muxAddr);
+		if (res == 0) {
+			res = i2c_smbus_access(fd, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data);
+		}
+		if (res == 0) {
+			ctrl = data.byte;
+		}
+	}
+
+	if (res < 0) {
+		printf("ERR: NO I2C MUX AT 0x%02x: %s\n", muxAddr, strerror(errno));
+		return -1;
+	}
+	muxSaved = ctrl;
+	muxSelected = ctrl;
+	return 0;
+}
+
+void muxRestore(int fd)
+{
+	if (muxAddr < 0 || muxSaved < 0 || muxSelected == muxSaved) {
+		return;
+	}
+	muxWrite(fd, (uint8_t)muxSaved);
+}
+
+// I2C_RDWR on the RTC channel. The PCA954x only switches channels on a STOP, so the select can only share the
+// ioctl with the transfer when the adapter can put a STOP between messages (I2C_M_STOP).
+int i2c_rdwr(int fd, struct i2c_rdwr_ioctl_data *iocall)
+{
+	if (muxAddr < 0 || muxSelected == muxControlByte()) {
+		return i2c_ioctl_rdwr(fd, iocall);
+	}
+
+	if (!muxCombine) {
+		if (muxWrite(fd, muxControlByte()) < 0) {
+			return -1;
+		}
+		return i2c_ioctl_rdwr(fd, iocall);
+	}
+
+	struct i2c_rdwr_ioctl_data combined;
+	struct i2c_msg i2c_msgs[3];
+	uint8_t ctrl = muxControlByte();
+
+	if (iocall->nmsgs > 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	i2c_msgs[0].addr = muxAddr;
+	i2c_msgs[0].flags = I2C_M_STOP; //write, then STOP so the channel switches
+	i2c_msgs[0].buf = &ctrl;
+	i2c_msgs[0].len = 1;
+	memcpy(&i2c_msgs[1], iocall->msgs, iocall->nmsgs * sizeof(struct i2c_msg));
+
+	combined.nmsgs = iocall->nmsgs + 1;
+	combined.msgs = i2c_msgs;
+
+	muxSelected = -1;
+	int res = i2c_ioctl_rdwr(fd, &combined);
+	if (res >= 0) {
+		muxSelected = ctrl;
+	}
+	return res;
+}
+
+// Mux channel and I2C_SLAVE for the SMBus paths.
+int i2c_prepare_smbus(int fd, uint8_t addr)
+{
+	if (muxSelect(fd) < 0) {
+		return -1;
+	}
+	return i2c_select_slave(fd, addr);
+}
+
+// One byte from whatever the device points at, used to check there is something on the address.
+int i2c_probe_read(int fd)
+{
+	if (i2cXferMode == I2C_XFER_RDWR) {
+		char buf[1];
+
+		RTC_PROBE4(i2c_xfer_start, i2cSlaveAddr, -1, 1, 0);
+		int64_t start = RTC_PROBE_ENABLED(i2c_xfer_done) ? probeClockNs() : 0;
+		int res = read(fd, buf, 1);
+		int err = res < 0 ? errno : (res == 1 ? 0 : EIO);
+		RTC_PROBE5(i2c_xfer_done, i2cSlaveAddr, -1, 1, err, RTC_PROBE_ENABLED(i2c_xfer_done) ? probeClockNs() - start : 0);
+
+		errno = err;
+		return res == 1 ? 0 : -1;
+	}
+
+	union i2c_smbus_data data;
+	return i2c_smbus_access(fd, I2C_SMBUS_READ, 0x00, I2C_SMBUS_BYTE_DATA, &data) < 0 ? -1 : 0;
+}
+
+// Register transactions straight on the bus, one transaction each. The i2c_reg_* functions below go through the
+// trace and print the errors.
+int i2c_bus_read_byte(int fd, uint8_t addr, uint8_t regaddr, uint8_t* content)
 {
+	if (i2cXferMode != I2C_XFER_RDWR) {
+		union i2c_smbus_data data;
+
+		if (i2c_prepare_smbus(fd, addr) < 0 || i2c_smbus_access(fd, I2C_SMBUS_READ, regaddr, I2C_SMBUS_BYTE_DATA, &data) < 0) {
+			return -1;
+		}
+		*content = data.byte;
+		return 0;
+	}
+
 	struct i2c_rdwr_ioctl_data iocall;    // structure pass to i2c driver
 	struct i2c_msg i2c_msgs[2];
 
@@ -156,16 +568,21 @@ int i2c_reg_read_byte(int fd, uint8_t addr, uint8_t regaddr, uint8_t* content)
 	i2c_msgs[1].buf = (char*) content;
 	i2c_msgs[1].len = 1;
 
-	if (ioctl(fd, I2C_RDWR, (unsigned long) &iocall) < 0) {
-		printf("ERR: %s:%s \n", __func__, strerror(errno));
-		return -1;
-	}
-
-	return 0;
+	return i2c_rdwr(fd, &iocall) < 0 ? -1 : 0;
 }
 
-int i2c_reg_write_byte(int fd, uint8_t addr, uint8_t regaddr, uint8_t content) 
+int i2c_bus_write_byte(int fd, uint8_t addr, uint8_t regaddr, uint8_t content)
 {
+	if (i2cXferMode != I2C_XFER_RDWR) {
+		union i2c_smbus_data data;
+
+		data.byte = content;
+		if (i2c_prepare_smbus(fd, addr) < 0 || i2c_smbus_access(fd, I2C_SMBUS_WRITE, regaddr, I2C_SMBUS_BYTE_DATA, &data) < 0) {
+			return -1;
+		}
+		return 0;
+	}
+
 	struct i2c_rdwr_ioctl_data iocall;    // structure pass to i2c driver
 	struct i2c_msg i2c_msgs;
 	uint8_t buffer[2];
@@ -181,782 +598,2974 @@ int i2c_reg_write_byte(int fd, uint8_t addr, uint8_t regaddr, uint8_t content)
 	i2c_msgs.buf = (char*) buffer;
 	i2c_msgs.len = sizeof(buffer);
 
-	if (ioctl(fd, I2C_RDWR, (unsigned long) &iocall) < 0) {
-		printf("ERR: %s:%s \n", __func__, strerror(errno));
-		return -1;
+	return i2c_rdwr(fd, &iocall) < 0 ? -1 : 0;
+}
+
+// I2C_RDWR or SMBus block only, the SMBus byte adapters are handled by i2c_reg_read_block().
+int i2c_bus_read_block(int fd, uint8_t addr, uint8_t regaddr, uint8_t* content, uint8_t len)
+{
+	if (i2cXferMode == I2C_XFER_RDWR) {
+		struct i2c_rdwr_ioctl_data iocall;
+		struct i2c_msg i2c_msgs[2];
+
+		iocall.nmsgs = 2;
+		iocall.msgs = i2c_msgs;
+
+		i2c_msgs[0].addr = addr;
+		i2c_msgs[0].flags = 0; //write
+		i2c_msgs[0].buf = (char*) &regaddr;
+		i2c_msgs[0].len = 1;
+
+		i2c_msgs[1].addr = addr;
+		i2c_msgs[1].flags = I2C_M_RD; //READ
+		i2c_msgs[1].buf = (char*) content;
+		i2c_msgs[1].len = len;
+
+		return i2c_rdwr(fd, &iocall) < 0 ? -1 : 0;
 	}
 
+	union i2c_smbus_data data;
+
+	data.block[0] = len;
+	if (i2c_prepare_smbus(fd, addr) < 0 || i2c_smbus_access(fd, I2C_SMBUS_READ, regaddr, I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0) {
+		return -1;
+	}
+	memcpy(content, &data.block[1], len);
 	return 0;
 }
 
-int BCDtoInt(unsigned char bcd) {
-    // Extract the high nibble (first 4 bits) and low nibble (last 4 bits)
-    int highNibble = (bcd >> 4) & 0xF; // Shift right by 4 bits and mask with 0xF
-    int lowNibble = bcd & 0xF;         // Mask with 0xF to get the last 4 bits
+int i2c_bus_write_block(int fd, uint8_t addr, uint8_t regaddr, const uint8_t* content, uint8_t len)
+{
+	if (i2cXferMode == I2C_XFER_RDWR) {
+		struct i2c_rdwr_ioctl_data iocall;
+		struct i2c_msg i2c_msgs;
+		uint8_t buffer[I2C_SMBUS_BLOCK_MAX + 1];
 
-    // Combine the nibbles to get the final integer
-    int val = highNibble * 10 + lowNibble;
+		buffer[0] = regaddr;
+		memcpy(&buffer[1], content, len);
 
-    return val;
-}
+		iocall.nmsgs = 1;
+		iocall.msgs = &i2c_msgs;
 
-uint8_t intToBCD(int val) {
-    return ((val/10*16) + (val%10));
+		i2c_msgs.addr = addr;
+		i2c_msgs.flags = 0; //write
+		i2c_msgs.buf = (char*) buffer;
+		i2c_msgs.len = len + 1;
+
+		return i2c_rdwr(fd, &iocall) < 0 ? -1 : 0;
+	}
+
+	union i2c_smbus_data data;
+
+	data.block[0] = len;
+	memcpy(&data.block[1], content, len);
+	if (i2c_prepare_smbus(fd, addr) < 0 || i2c_smbus_access(fd, I2C_SMBUS_WRITE, regaddr, I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0) {
+		return -1;
+	}
+	return 0;
 }
 
-int calculateDayOfWeek(int d, int m, int y)
-{
-    static int t[] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
-    y -= m < 3;
-    return (y + y / 4 - y / 100 + y / 400 + t[m - 1] + d) % 7;
+#if RTC_WITH_TRACE
+// Transaction trace: record=FILE logs every register transaction with its result and timing, replay=FILE[,SCALE]
+// feeds a trace back in place of the bus. Host byte order, a header and then one entry per transaction followed
+// by its len data bytes (what was read or written).
+const uint32_t I2C_TRACE_MAGIC = 0x54433249;   // "I2CT"
+const uint16_t I2C_TRACE_VERSION = 2;   // 2: 64 bit durations
+
+const uint8_t I2C_TRACE_PROBE = 0;
+const uint8_t I2C_TRACE_READ_BYTE = 1;
+const uint8_t I2C_TRACE_WRITE_BYTE = 2;
+const uint8_t I2C_TRACE_READ_BLOCK = 3;
+const uint8_t I2C_TRACE_WRITE_BLOCK = 4;
+
+struct i2cTraceHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t xferMode;       // transfer strategy the trace was taken with, replay uses the same
+    uint8_t bus;
+    int64_t startSec;       // CLOCK_REALTIME when recording started
+} __attribute__((packed));
+
+struct i2cTraceEntry {
+    uint8_t op;
+    uint8_t addr;
+    uint8_t reg;
+    uint8_t len;
+    uint16_t err;           // errno, 0 on success
+    uint64_t durationNs;    // a stalled bus can hold a transaction for seconds
+    uint64_t startNs;       // since the start of the trace
+} __attribute__((packed));
+
+FILE *traceRecordFile = NULL;
+FILE *traceReplayFile = NULL;
+double traceReplayScale = 1.0;  // replayed gaps and durations = recorded ones * scale, 0 replays as fast as possible
+int64_t traceStartNs = 0;
+unsigned traceCount = 0;
+unsigned traceMismatches = 0;   // transaction sequence differs from the trace
+unsigned traceDataDiffs = 0;    // same transaction, different data written
+int64_t traceRecordedNs = 0;
+int64_t traceReplayedNs = 0;
+int64_t traceReplayPrevStart = -1;      // when the previous replayed transaction started, -1 before the first
+uint64_t traceReplayPrevRecorded = 0;   // and its recorded start
+bool traceReplayEnded = false;          // ran off the end of the trace or hit a corrupt entry
+
+const char *traceOpName(uint8_t op){
+    static const char *names[] = { "probe", "read byte", "write byte", "read block", "write block" };
+    return op < 5 ? names[op] : "unknown";
 }
 
-void processISL1208Time(uint8_t RTCseconds, uint8_t RTCminutes, uint8_t RTChours, uint8_t RTCweekday, uint8_t RTCday, uint8_t RTCmonth, uint8_t RTCyear, bool printTime, bool setTime, uint8_t RTC_StatusReg){
-    //hwclock output: 2019-09-20 11:08:05.566357+00:00
-    bool isTwentyFourHours = false;
-    bool isPM = false;
-    int secondsCalc;
-    int minutesCalc;
-    int hoursCalc;
-    int dayCalc;
-    int monthCalc;
-    int yearCalc;
-    int weekdayCalc;
+int traceOpenRecord(const char *path){
+    traceRecordFile = fopen(path, "wb");
+    if (traceRecordFile == NULL){
+        printf("ERR: FAILED TO OPEN TRACE %s: %s\n", path, strerror(errno));
+        return -1;
+    }
 
-    uint8_t ones;
-    uint8_t tens;
+    struct i2cTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = I2C_TRACE_MAGIC;
+    header.version = I2C_TRACE_VERSION;
+    header.xferMode = (uint8_t)i2cXferMode;
+    header.bus = (uint8_t)i2cBus;
+    header.startSec = (int64_t)time(NULL);
+    fwrite(&header, sizeof(header), 1, traceRecordFile);
+    fflush(traceRecordFile);
+
+    traceStartNs = probeClockNs();
+    return 0;
+}
 
-    secondsCalc = BCDtoInt(RTCseconds);
-    minutesCalc = BCDtoInt(RTCminutes);
+int traceOpenReplay(const char *path){
+    struct i2cTraceHeader header;
 
-    // 24-hour check fix
-    if ((RTChours & 0x80) != 0){
-        isTwentyFourHours = true;
-    }else{
-        isTwentyFourHours = false;
+    traceReplayFile = fopen(path, "rb");
+    if (traceReplayFile == NULL){
+        printf("ERR: FAILED TO OPEN TRACE %s: %s\n", path, strerror(errno));
+        return -1;
     }
-
-    // Hour extraction corrected
-    if (!isTwentyFourHours){
-        if ((RTChours & 0x20) != 0){
-            // PM
-            hoursCalc = BCDtoInt(RTChours & 0x1F);
-            if (hoursCalc != 12){
-                hoursCalc += 12;
-            }
-        }else{
-            // AM
-            hoursCalc = BCDtoInt(RTChours & 0x1F);
-            if (hoursCalc == 12){
-                hoursCalc = 0;
-            }
-        }
-    }else{
-        // Corrected: Keep bits 6:0 for 24h BCD
-        hoursCalc = BCDtoInt(RTChours & 0x7F);
+    if (fread(&header, sizeof(header), 1, traceReplayFile) != 1 || header.magic != I2C_TRACE_MAGIC || header.version != I2C_TRACE_VERSION){
+        printf("ERR: %s IS NOT A VERSION %d I2C TRACE\n", path, I2C_TRACE_VERSION);
+        fclose(traceReplayFile);
+        traceReplayFile = NULL;
+        return -1;
     }
 
-    dayCalc = BCDtoInt(RTCday);
-    monthCalc = BCDtoInt(RTCmonth);
-    yearCalc = BCDtoInt(RTCyear) + 2000;
-    weekdayCalc = BCDtoInt(RTCweekday);
-
-    int dayOfWeekCalc = calculateDayOfWeek(dayCalc, monthCalc, yearCalc);
-    int isClockRunning = (RTCseconds & 0x10);
+    i2cXferMode = header.xferMode;
+    i2cBus = header.bus;
+    //Recorded transactions take tens of microseconds, the default 50us timer slack would swamp them.
+    prctl(PR_SET_TIMERSLACK, 1);
+    printf("RPL: %s, bus %d, %s, recorded at %lld, timing x%.2f\n", path, header.bus, i2cXferName(header.xferMode), (long long)header.startSec, traceReplayScale);
+    return 0;
+}
 
-    if (dayOfWeekCalc != RTCweekday){
-        printf("WRN: RTC Weekday out of sync!\n");
-        printf("RTC Weekday: %d\n", RTCweekday);
-        printf("Calculated weekday: %d\n", dayOfWeekCalc);
+// One transaction into the trace, flushed right away so a crash in the field still leaves the trace behind.
+void traceAppend(uint8_t op, uint8_t addr, uint8_t reg, const uint8_t *data, uint8_t len, int res, int64_t start){
+    int err = errno;
+    int64_t end = probeClockNs();
+
+    struct i2cTraceEntry entry;
+    entry.op = op;
+    entry.addr = addr;
+    entry.reg = reg;
+    entry.len = data != NULL ? len : 0;
+    entry.err = res != 0 ? (uint16_t)(err != 0 ? err : EIO) : 0;
+    entry.durationNs = (uint64_t)(end - start);
+    entry.startNs = (uint64_t)(start - traceStartNs);
+
+    fwrite(&entry, sizeof(entry), 1, traceRecordFile);
+    if (entry.len > 0){
+        fwrite(data, 1, entry.len, traceRecordFile);
     }
+    fflush(traceRecordFile);
 
-    if (isClockRunning == 0){
-        printf("WRN: RTC Oscillator has stopped!\n");
+    traceCount++;
+    traceRecordedNs += end - start;
+    errno = err;
+}
+
+void traceSleepUntil(int64_t until){
+    struct timespec ts;
+    ts.tv_sec = until / 1000000000LL;
+    ts.tv_nsec = until % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
     }
+}
 
-    if (printTime){
-        printf("RTC: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc);
-        printf("TYP: ISL1208\n");
+// Next transaction from the trace in place of the bus. Reads get the recorded data, writes are checked against
+// it, failures come back with the recorded errno. The call starts no sooner after the previous one than it did
+// when recorded and takes the recorded time, both times the scale, so rollover polling and watch mode see the
+// same timing they saw on the bus.
+int traceReplay(uint8_t op, uint8_t addr, uint8_t reg, uint8_t *data, uint8_t len){
+    struct i2cTraceEntry entry;
+    uint8_t recorded[I2C_SMBUS_BLOCK_MAX];
+    int64_t start = probeClockNs();
+
+    if (traceReplayEnded){
+        errno = ENODATA;
+        return -1;
     }
 
-    if (setTime){
-        // Fixed: allocate buffer for datetime string
-        char datetimeSet[32];
-        struct tm tm;
-        struct timeval tv;
+    //A trace comes in from the field, its lengths are checked before any data is read.
+    if (fread(&entry, sizeof(entry), 1, traceReplayFile) != 1 || entry.len > I2C_SMBUS_BLOCK_MAX || fread(recorded, 1, entry.len, traceReplayFile) != entry.len){
+        printf("RPL: trace ended or corrupt before %s 0x%02x:0x%02x\n", traceOpName(op), addr, reg);
+        traceMismatches++;
+        traceReplayEnded = true;
+#if RTC_WITH_DAEMONS
+        keepRunning = 0;
+#endif
+        errno = ENODATA;
+        return -1;
+    }
+    traceCount++;
 
-        sprintf(datetimeSet, "%04d-%02d-%02d %02d:%02d:%02d", yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc);
+    //The tool's own time since the previous transaction counts toward the recorded gap.
+    if (traceReplayScale > 0.0 && traceReplayPrevStart >= 0 && entry.startNs > traceReplayPrevRecorded){
+        traceSleepUntil(traceReplayPrevStart + (int64_t)((entry.startNs - traceReplayPrevRecorded) * traceReplayScale));
+        start = probeClockNs();
+    }
+    traceReplayPrevStart = start;
+    traceReplayPrevRecorded = entry.startNs;
+
+    uint8_t expectLen = data != NULL ? len : 0;
+    if (entry.op != op || entry.addr != addr || entry.reg != reg || entry.len != expectLen){
+        printf("RPL: MISMATCH at #%u, trace has %s 0x%02x:0x%02x len %d, tool did %s 0x%02x:0x%02x len %d\n", traceCount, traceOpName(entry.op), entry.addr, entry.reg, entry.len, traceOpName(op), addr, reg, expectLen);
+        traceMismatches++;
+        errno = EPROTO;
+        return -1;
+    }
 
-        if (strptime(datetimeSet, "%Y-%m-%d %H:%M:%S", &tm) == NULL) {
-            fprintf(stderr, "TIME-DATE PARSE FAIL\n");
-            return;
+    if (entry.err == 0 && entry.len > 0){
+        if (op == I2C_TRACE_READ_BYTE || op == I2C_TRACE_READ_BLOCK){
+            memcpy(data, recorded, entry.len);
+        }else if (memcmp(data, recorded, entry.len) != 0){
+            printf("RPL: #%u %s 0x%02x:0x%02x wrote different data than the trace\n", traceCount, traceOpName(op), addr, reg);
+            traceDataDiffs++;
         }
+    }
 
-        time_t t = mktime(&tm);
-        if (t == -1) {
-            printf("mktime() call failed!\n");
-            return;
-        }
+    if (traceReplayScale > 0.0){
+        traceSleepUntil(start + (int64_t)(entry.durationNs * traceReplayScale));
+    }
+    traceRecordedNs += entry.durationNs;
+    traceReplayedNs += probeClockNs() - start;
 
-        tv.tv_sec = t;
-        tv.tv_usec = 0;
+    if (entry.err != 0){
+        errno = entry.err;
+        return -1;
+    }
+    return 0;
+}
 
-        if (settimeofday(&tv, NULL) < 0) {
-            printf("HCTOSYS FAIL\n");
-            return;
+// Summary at exit, non-zero when a replay went off the trace.
+int traceClose(){
+    if (traceRecordFile != NULL){
+        printf("REC: %u transactions, %lld us on the bus\n", traceCount, (long long)(traceRecordedNs / 1000));
+        fclose(traceRecordFile);
+        traceRecordFile = NULL;
+    }
+    if (traceReplayFile != NULL){
+        struct i2cTraceEntry entry;
+        if (!traceReplayEnded && fread(&entry, sizeof(entry), 1, traceReplayFile) == 1){
+            printf("RPL: MISMATCH, the trace has more transactions after #%u\n", traceCount);
+            traceMismatches++;
         }
-
-        printf("HCTOSYS OK\n");
+        printf("RPL: %u transactions, %u mismatches, %u write differences, %lld us replayed (%lld us recorded)\n", traceCount, traceMismatches, traceDataDiffs, (long long)(traceReplayedNs / 1000), (long long)(traceRecordedNs / 1000));
+        fclose(traceReplayFile);
+        traceReplayFile = NULL;
+        return traceMismatches == 0 ? 0 : 1;
     }
+    return 0;
 }
+#endif
 
-void processBQ32KTime(uint8_t RTCseconds, uint8_t RTCminutes, uint8_t RTChours, uint8_t RTCweekday, uint8_t RTCday, uint8_t RTCmonth, uint8_t RTCyear, bool printTime, bool setTime){
-    //hwclock output: 2019-09-20 11:08:05.566357+00:00
+int i2c_reg_read_byte(int fd, uint8_t addr, uint8_t regaddr, uint8_t* content) 
+{
+	int res;
+
+#if RTC_WITH_TRACE
+	if (traceReplayFile != NULL) {
+		res = traceReplay(I2C_TRACE_READ_BYTE, addr, regaddr, content, 1);
+	} else {
+		int64_t start = traceRecordFile != NULL ? probeClockNs() : 0;
+		res = i2c_bus_read_byte(fd, addr, regaddr, content);
+		if (traceRecordFile != NULL) {
+			traceAppend(I2C_TRACE_READ_BYTE, addr, regaddr, content, 1, res, start);
+		}
+	}
+#else
+	res = i2c_bus_read_byte(fd, addr, regaddr, content);
+#endif
 
-    int secondsCalc;
-    int minutesCalc;
-    int hoursCalc;
-    int dayCalc;
-    int monthCalc;
-    int yearCalc;
+	if (res < 0) {
+		printf("ERR: %s:%s \n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
-    uint8_t ones;
-    uint8_t tens;
+int i2c_reg_write_byte(int fd, uint8_t addr, uint8_t regaddr, uint8_t content) 
+{
+	int res;
+
+#if RTC_WITH_TRACE
+	if (traceReplayFile != NULL) {
+		res = traceReplay(I2C_TRACE_WRITE_BYTE, addr, regaddr, &content, 1);
+	} else {
+		int64_t start = traceRecordFile != NULL ? probeClockNs() : 0;
+		res = i2c_bus_write_byte(fd, addr, regaddr, content);
+		if (traceRecordFile != NULL) {
+			traceAppend(I2C_TRACE_WRITE_BYTE, addr, regaddr, &content, 1, res, start);
+		}
+	}
+#else
+	res = i2c_bus_write_byte(fd, addr, regaddr, content);
+#endif
 
-    ones = RTCseconds & 0x0F;
-    tens = (RTCseconds & 0x70) >> 4;
-    secondsCalc = ((10 * tens) + ones);
+	if (res < 0) {
+		printf("ERR: %s:%s \n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
-    ones = RTCminutes & 0x0F;
-    tens = (RTCminutes & 0x70) >> 4;
-    minutesCalc = ((10 * tens) + ones);
+// Read len consecutive registers (max 32) in as few transactions as the adapter allows.
+int i2c_reg_read_block(int fd, uint8_t addr, uint8_t regaddr, uint8_t* content, uint8_t len)
+{
+	struct timespec start;
+	struct timespec end;
+	int res = 0;
 
-    ones = RTChours & 0x0F;
-    tens = (RTChours & 0x30) >> 4;
-    hoursCalc = ((10 * tens) + ones);
+	if (len > I2C_SMBUS_BLOCK_MAX) {
+		return -1;
+	}
 
-    ones = RTCday & 0x0F;
-    tens = (RTCday & 0x30) >> 4;
-    dayCalc = ((10 * tens) + ones);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (i2cXferMode == I2C_XFER_SMBUS_BYTE) {
+		//Every byte is its own transaction here, a seconds rollover in between would tear the time.
+		//Keep reading until two passes agree.
+		uint8_t previous[I2C_SMBUS_BLOCK_MAX];
+		int pass;
+
+		res = -1;
+		for (pass = 0; pass < 5; pass++) {
+			uint8_t i;
+			for (i = 0; i < len; i++) {
+				if (i2c_reg_read_byte(fd, addr, regaddr + i, &content[i]) != 0) {
+					return -1;
+				}
+			}
+			if (pass > 0 && memcmp(previous, content, len) == 0) {
+				res = 0;
+				break;
+			}
+			memcpy(previous, content, len);
+		}
+		if (res != 0) {
+			errno = EAGAIN;
+		}
+#if RTC_WITH_TRACE
+	} else if (traceReplayFile != NULL) {
+		res = traceReplay(I2C_TRACE_READ_BLOCK, addr, regaddr, content, len);
+	} else {
+		int64_t traceStart = traceRecordFile != NULL ? probeClockNs() : 0;
+		res = i2c_bus_read_block(fd, addr, regaddr, content, len);
+		if (traceRecordFile != NULL) {
+			traceAppend(I2C_TRACE_READ_BLOCK, addr, regaddr, content, len, res, traceStart);
+		}
+#else
+	} else {
+		res = i2c_bus_read_block(fd, addr, regaddr, content, len);
+#endif
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-    ones = RTCmonth & 0x0F;
-    tens = (RTCmonth & 0x10) >> 4;
-    monthCalc = ((10 * tens) + ones);
+	if (res < 0) {
+		printf("ERR: %s:%s \n", __func__, strerror(errno));
+		return -1;
+	}
 
-    ones = RTCyear & 0x0F;
-    tens = (RTCyear & 0xF0) >> 4;
-    yearCalc = ((10 * tens) + ones) + 2000;
+	lastReadCostNs = timespecToNs(&end) - timespecToNs(&start);
+	return 0;
+}
 
+// Write len consecutive registers (max 32) in as few transactions as the adapter allows.
+int i2c_reg_write_block(int fd, uint8_t addr, uint8_t regaddr, const uint8_t* content, uint8_t len)
+{
+	int res = 0;
 
-    // printf("Calculated hours: %d\n", hoursCalc);
-    // printf("Calculated minutes: %d\n", minutesCalc);
-    // printf("Calculated seconds: %d\n", secondsCalc);
-    // printf("Calculated day: %d\n", dayCalc);
-    // printf("Calculated month: %d\n", monthCalc);
-    // printf("Calculated year: %d\n", yearCalc);
+	if (len > I2C_SMBUS_BLOCK_MAX) {
+		return -1;
+	}
+
+	if (i2cXferMode == I2C_XFER_SMBUS_BYTE) {
+		uint8_t i;
+		for (i = 0; i < len; i++) {
+			if (i2c_reg_write_byte(fd, addr, regaddr + i, content[i]) != 0) {
+				return -1;
+			}
+		}
+#if RTC_WITH_TRACE
+	} else if (traceReplayFile != NULL) {
+		res = traceReplay(I2C_TRACE_WRITE_BLOCK, addr, regaddr, (uint8_t *)content, len);
+	} else {
+		int64_t traceStart = traceRecordFile != NULL ? probeClockNs() : 0;
+		res = i2c_bus_write_block(fd, addr, regaddr, content, len);
+		if (traceRecordFile != NULL) {
+			traceAppend(I2C_TRACE_WRITE_BLOCK, addr, regaddr, content, len, res, traceStart);
+		}
+#else
+	} else {
+		res = i2c_bus_write_block(fd, addr, regaddr, content, len);
+#endif
+	}
 
+	if (res < 0) {
+		printf("ERR: %s:%s \n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
-    int dayOfWeekCalc = calculateDayOfWeek(dayCalc, monthCalc, yearCalc);
-    int isClockRunning = (RTCseconds & 0x80);
+// Kernel name of the i2c client, e.g. 0-006f
+void i2cDeviceName(char *name, size_t len, uint8_t addr){
+    snprintf(name, len, "%d-%04x", i2cBus, addr);
+}
 
+#if RTC_WITH_SYSFS_BIND
+// What force actually unbound, so only that driver name gets bound back.
+struct pendingRebind {
+    uint8_t addr;
+    const char *driver;
+};
 
-    dayOfWeekCalc += 1;
-    if (dayOfWeekCalc != RTCweekday){
-        printf("WRN: RTC Weekday out of sync!\n");
-        printf("RTC Weekday: %d\n", RTCweekday);
-        printf("Calculated weekday: %d\n", dayOfWeekCalc);
+struct pendingRebind pendingRebinds[2];
+int pendingRebindCount = 0;
+
+void unbindDevices(uint8_t addr){
+    const char *drivers[2];
+    char device[16];
+    int i;
+    i2cDeviceName(device, sizeof(device), addr);
+
+    if (addr == BQ32K){
+        drivers[0] = "bq32k";
+        drivers[1] = "rtc-bq32k";
+    }else if (addr == ISL1208){
+        drivers[0] = "isl1208";
+        drivers[1] = "rtc-isl1208";
+    }else{
+        return;
     }
 
-    //hwclock output: 2019-09-20 11:08:05.566357+00:00
-    if (isClockRunning == 1){
-        printf("WRN: RTC Oscillator has stopped!\n");
+    for (i = 0; i < 2; i++){
+        if (unbind_device(device, drivers[i]) == 0){
+            if (pendingRebindCount < 2){
+                pendingRebinds[pendingRebindCount].addr = addr;
+                pendingRebinds[pendingRebindCount].driver = drivers[i];
+                pendingRebindCount++;
+            }
+            return;
+        }
     }
+}
 
-    if (printTime){
-        printf("RTC: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc);
-        printf("TYP: BQ32K\n");
+void rebindDevices(){
+    char device[16];
+    int i;
+    for (i = 0; i < pendingRebindCount; i++){
+        i2cDeviceName(device, sizeof(device), pendingRebinds[i].addr);
+        if (bind_device(device, pendingRebinds[i].driver) != 0){
+            printf("ERR: FAILED TO BIND %s TO %s: %s\n", device, pendingRebinds[i].driver, strerror(errno));
+        }
     }
+    pendingRebindCount = 0;
+}
 
-    //Set the system time from the RTC!
-    if (setTime){
-        // Define the new time as a string
-        char* datetimeSet;
-        struct tm tm;
-        struct timeval tv;
+// The bind runs the driver probe and registers the rtc device before the write returns, so it goes to a detached
+// child once the result is out. The child inherits the bus lock, the next instance waits until the driver is back.
+void rebindDevicesDeferred(){
+    char device[16];
+    int i;
 
-        //convert the calculated RTC time to the date string.
-        sprintf(datetimeSet, "%04d-%02d-%02d %02d:%02d:%02d", yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc);
+    if (pendingRebindCount == 0){
+        return;
+    }
 
-        // Parse the date and time string
-        if (strptime(datetimeSet, "%Y-%m-%d %H:%M:%S", &tm) == NULL) {
-            fprintf(stderr, "ERR: TIME-DATE PARSE FAIL\n");
-            return;
-        }
+    fflush(stdout);
+    int64_t start = probeClockNs();
+    pid_t pid = fork();
+    if (pid < 0){
+        printf("WRN: FORK FAILED: %s, rebinding in the foreground\n", strerror(errno));
+        rebindDevices();
+        return;
+    }
 
-        // Convert the parsed time to a time_t (Unix timestamp)
-        time_t t = mktime(&tm);
-        if (t == -1) {
-            printf("ERR: mktime() call failed!\n");
-            return;
+    if (pid == 0){
+        setsid();
+        int devNull = open("/dev/null", O_RDWR);
+        if (devNull >= 0){
+            dup2(devNull, STDIN_FILENO);
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+            if (devNull > STDERR_FILENO){
+                close(devNull);
+            }
         }
 
-        // Set the timeval structure
-        tv.tv_sec = t;
-        tv.tv_usec = 0;
-
-        // Set the system time
-        if (settimeofday(&tv, NULL) < 0) {
-            printf("HCTOSYS FAIL\n");
-            return;
+        openlog("RTCSyncTool", LOG_PID, LOG_DAEMON);
+        for (i = 0; i < pendingRebindCount; i++){
+            i2cDeviceName(device, sizeof(device), pendingRebinds[i].addr);
+            int64_t bindStart = probeClockNs();
+            int res = bind_device(device, pendingRebinds[i].driver);
+            long long us = (long long)((probeClockNs() - bindStart) / 1000);
+            if (res == 0){
+                syslog(LOG_INFO, "bound %s to %s in %lld us, off the critical path", device, pendingRebinds[i].driver, us);
+            }else{
+                syslog(LOG_ERR, "failed to bind %s to %s: %s", device, pendingRebinds[i].driver, strerror(errno));
+            }
         }
+        closelog();
+        _exit(0);
+    }
 
-        printf("HCTOSYS OK\n");
+    long long handoff = (long long)((probeClockNs() - start) / 1000);
+    for (i = 0; i < pendingRebindCount; i++){
+        i2cDeviceName(device, sizeof(device), pendingRebinds[i].addr);
+        printf("BND: rebinding %s to %s in the background (pid %d, handed off in %lld us)\n", device, pendingRebinds[i].driver, (int)pid, handoff);
     }
+    pendingRebindCount = 0;
 }
+#endif
 
-void readISL1208(int fd, bool printTime, bool setSystemTime){
-    uint8_t addr = ISL1208;
-    uint8_t regaddr = 0x00; // Register offset to read from
-
-    uint8_t seconds;    // in reg 0x00
-    uint8_t minutes;    // in reg 0x01
-    uint8_t hours;      // in reg 0x02
-    uint8_t day;        // in reg 0x03
-    uint8_t month;      // in reg 0x04
-    uint8_t year;       // in reg 0x05
-    uint8_t weekday;    // in reg 0x06
-    uint8_t rtcStatus;   // in reg 0x07
-
-    int err = 0;
-
-    if (i2c_reg_read_byte(fd, addr, regaddr, &seconds) == 0) {
-        //printf("Read seconds: %d\n", seconds);
-        regaddr += 1;
-
-        if (i2c_reg_read_byte(fd, addr, regaddr, &minutes) == 0){
-            //printf("Read minutes: %d\n", minutes);
-            regaddr += 1;
-
-            if (i2c_reg_read_byte(fd, addr, regaddr, &hours) == 0){
-                //printf("Read hours: %d\n", hours);
-                regaddr += 1;
-
-                if (i2c_reg_read_byte(fd, addr, regaddr, &day) == 0){
-                    //printf("Read day: %d\n", day);
-                    regaddr += 1;
-
-                    if (i2c_reg_read_byte(fd, addr, regaddr, &month) == 0){
-                        //printf("Read month: %d\n", month);
-                        regaddr += 1;
-
-                        if (i2c_reg_read_byte(fd, addr, regaddr, &year) == 0){
-                            //printf("Read year: %d\n", year);
-                            regaddr += 1;
-
-                            if (i2c_reg_read_byte(fd, addr, regaddr, &weekday) == 0){
-                                //printf("Read weekday: %d\n", weekday);
-                                regaddr += 1;
-                                if (i2c_reg_read_byte(fd, addr, regaddr, &rtcStatus) == 0){
-                                    //printf("Read status: %d\n", rtcStatus);
-                                    processISL1208Time(seconds, minutes, hours, weekday, day, month, year, printTime, setSystemTime, rtcStatus);
-                                }else{
-                                    printf("ERR: Failed to read the 'status register' from the ISL1208 chip!\n");
-                                }
-                            }else{
-                                printf("ERR: Failed to read the 'weekday' from the ISL1208 chip!\n");
-                            }
-                        }else{
-                            printf("ERR: Failed to read the 'year' from the ISL1208 chip!\n");
-                        }
-                    }else{
-                        printf("ERR: Failed to read the 'month' from the ISL1208 chip!\n");
-                    }
-                }else{
-                    printf("ERR: Failed to read the 'day' from the ISL1208 chip!\n");
-                }
+int probeI2CDevice(int fd, uint8_t addr, uint8_t forceUnbind){
+    if (muxSelect(fd) != 0){
+        return 1;
+    }
+
+    if (ioctl(fd, I2C_SLAVE, addr) < 0) {
+#if RTC_WITH_SYSFS_BIND
+        if (forceUnbind == 1){
+            //printf("Unbinding driver...\n");
+            unbindDevices(addr);
+
+            if (ioctl(fd, I2C_SLAVE, addr) < 0) {
+                printf("ERR: FAILED TO TALK TO SLAVE 0x%02x AFTER UNBIND\n", addr);
+                return 1;
             }else{
-                printf("ERR: Failed to read the 'hours' from the ISL1208 chip!\n");
+                i2cSlaveAddr = addr;
+                if (i2c_probe_read(fd) == 0) {
+                    //printf("Device found at address 0x%02x\n", addr);
+                    return 0;
+                } else {
+                    //printf("No device at address 0x%02x\n", addr);
+                    return 1;
+                }
             }
         }else{
-            printf("ERR: Failed to read the 'minutes' from the ISL1208 chip!\n");
+            printf("ERR: FAILED TO TALK TO SLAVE 0x%02x\n", addr);
         }
+#else
+        (void)forceUnbind;
+        printf("ERR: FAILED TO TALK TO SLAVE 0x%02x\n", addr);
+#endif
+        return 1;
+    }
+
+    i2cSlaveAddr = addr;
+    if (i2c_probe_read(fd) == 0) {
+        //printf("Device found at address 0x%02x\n", addr);
+        return 0;
     } else {
-        printf("ERR: Failed to read the 'seconds' from the ISL1208 chip!\n");
+        //printf("No device at address 0x%02x\n", addr);
+        return 1;
     }
 }
 
-void readBQ32K(int fd, bool printTime, bool setSystemTime){
-    uint8_t addr = BQ32K;
-    uint8_t regaddr = 0x00; // Register to read from
+int probeRTC(int fd, uint8_t addr, uint8_t forceUnbind){
+#if RTC_WITH_TRACE
+    if (traceReplayFile != NULL){
+        if (traceReplay(I2C_TRACE_PROBE, addr, 0, NULL, 0) != 0){
+            return 1;
+        }
+        i2cSlaveAddr = addr;
+        return 0;
+    }
+    int64_t traceStart = traceRecordFile != NULL ? probeClockNs() : 0;
+#endif
 
-    uint8_t seconds;    // in reg 0x00
-    uint8_t minutes;    // in reg 0x01
-    uint8_t hours;      // in reg 0x02
-
-    uint8_t weekday;    // in reg 0x03
-    uint8_t day;        // in reg 0x04
-    uint8_t month;      //in reg 0x05
-    uint8_t year;       //in reg 0x06
-
-    int err = 0;
-
-    if (i2c_reg_read_byte(fd, addr, regaddr, &seconds) == 0) {
-        //printf("Read seconds: %d\n", seconds);
-        regaddr += 1;
-
-        if (i2c_reg_read_byte(fd, addr, regaddr, &minutes) == 0){
-            //printf("Read minutes: %d\n", minutes);
-            regaddr += 1;
-
-            if (i2c_reg_read_byte(fd, addr, regaddr, &hours) == 0){
-                //printf("Read hours: %d\n", hours);
-                regaddr += 1;
-
-                if (i2c_reg_read_byte(fd, addr, regaddr, &weekday) == 0){
-                    //printf("Read weekday: %d\n", weekday);
-                    regaddr += 1;
-
-                    if (i2c_reg_read_byte(fd, addr, regaddr, &day) == 0){
-                        //printf("Read day: %d\n", day);
-                        regaddr += 1;
-
-                        if (i2c_reg_read_byte(fd, addr, regaddr, &month) == 0){
-                            //printf("Read month: %d\n", month);
-                            regaddr += 1;
-
-                            if (i2c_reg_read_byte(fd, addr, regaddr, &year) == 0){
-                                //printf("Read year: %d\n", year);
-                                processBQ32KTime(seconds, minutes, hours, weekday, day, month, year, printTime, setSystemTime);
-                            }else{
-                                printf("ERR: Failed to read the 'year' from the BQ32K chip!\n");
-                            }
-                        }else{
-                            printf("ERR: Failed to read the 'month' from the BQ32K chip!\n");
-                        }
-                    }else{
-                        printf("ERR: Failed to read the 'day' from the BQ32K chip!\n");
-                    }
-                }else{
-                    printf("ERR: Failed to read the 'weekday' from the BQ32K chip!\n");
-                }
-            }else{
-                printf("ERR: Failed to read the 'hours' from the BQ32K chip!\n");
+    RTC_PROBE1(probe_start, addr);
+    int64_t start = RTC_PROBE_ENABLED(probe_done) ? probeClockNs() : 0;
+    int res = probeI2CDevice(fd, addr, forceUnbind);
+    RTC_PROBE3(probe_done, addr, res, RTC_PROBE_ENABLED(probe_done) ? probeClockNs() - start : 0);
+
+#if RTC_WITH_TRACE
+    if (traceRecordFile != NULL){
+        traceAppend(I2C_TRACE_PROBE, addr, 0, NULL, 0, res, traceStart);
+    }
+#endif
+    return res;
+}
+
+void printHelp(){
+#if RTC_BOOT_MINIMAL
+    printf("\nRTCSyncTool boot build usage:\nSet system time from RTC -> ./RTCSyncTool hctosys\n");
+#else
+    printf("\nRTCSyncTool usage:\nReading the RTC -> ./RTCSyncTool get\nSet system time from RTC -> ./RTCSyncTool hctosys\nSet RTC Time from System -> ./RTCSyncTool systohc\nPublish RTC snapshots to shared memory -> ./RTCSyncTool publish\nServe the RTC as NTP SHM refclock -> ./RTCSyncTool refclock [unit=0]\nSteer the system clock onto the RTC -> ./RTCSyncTool steer [kp=..] [ki=..] [interval=..]\nSimulate the steering loop -> ./RTCSyncTool steersim [offset=..] [ppm=..]\nSet the RTC whenever the system clock is stepped -> ./RTCSyncTool watch [threshold=100]\nTo force read the i2c device, just add 'force' to your command.\nOther bus -> add 'bus=1', RTC behind a PCA954x mux -> add 'mux=0x70:2' (PCA9540/2/4: 'mux=0x70:1:pca9542')\nRecord the i2c transactions -> add 'record=trace.bin', run from a trace instead of the bus -> add 'replay=trace.bin' or 'replay=trace.bin,0.5'\n");
+#endif
+}
+
+int BCDtoInt(unsigned char bcd) {
+    // Extract the high nibble (first 4 bits) and low nibble (last 4 bits)
+    int highNibble = (bcd >> 4) & 0xF; // Shift right by 4 bits and mask with 0xF
+    int lowNibble = bcd & 0xF;         // Mask with 0xF to get the last 4 bits
+
+    // Combine the nibbles to get the final integer
+    int val = highNibble * 10 + lowNibble;
+
+    return val;
+}
+
+uint8_t intToBCD(int val) {
+    return ((val/10*16) + (val%10));
+}
+
+int calculateDayOfWeek(int d, int m, int y)
+{
+    static int t[] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+    y -= m < 3;
+    return (y + y / 4 - y / 100 + y / 400 + t[m - 1] + d) % 7;
+}
+
+// The RTC holds local time, same as what hctosys hands to mktime().
+time_t rtcToEpoch(int year, int month, int day, int hours, int minutes, int seconds){
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = day;
+    tm.tm_hour = hours;
+    tm.tm_min = minutes;
+    tm.tm_sec = seconds;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Stamp the snapshot with the middle of the bus read and the RTC offset at that point.
+void stampSnapshot(struct rtc_snapshot *snap, const struct timespec *readStart, const struct timespec *readEnd){
+    int64_t startNs = timespecToNs(readStart);
+    int64_t endNs = timespecToNs(readEnd);
+    int64_t sampleNs = startNs + (endNs - startNs) / 2;
+
+    snap->sampleSec = sampleNs / 1000000000LL;
+    snap->sampleNsec = (int32_t)(sampleNs % 1000000000LL);
+    snap->readCostNsec = (int32_t)(endNs - startNs);
+    snap->offsetNsec = snap->rtcEpoch * 1000000000LL - sampleNs;
+}
+
+// Drift history: RTC-vs-system offsets paired with the board temperature, used to predict how far the RTC
+// wandered while the system was off. Lines are "S <system epoch> <offset s> <temp C>" and "R <system epoch>"
+// for each systohc, which resets the RTC offset back to zero.
+const char *DRIFT_LOG_DIR = "/var/lib/rtcsynctool";
+const char *DRIFT_LOG_PATH = "/var/lib/rtcsynctool/drift.log";
+const long DRIFT_LOG_MAX_BYTES = 128 * 1024;
+const int DRIFT_SAMPLE_INTERVAL = 600;      // seconds between samples in the publish loop
+const double DRIFT_MIN_SPAN = 86400.0;      // RTC offsets only have 1s resolution, need a long baseline
+const double DRIFT_TURNOVER_TEMP = 25.0;    // typical turnover point of a 32kHz tuning fork crystal
+const double DRIFT_MIN_TEMP_RANGE = 5.0;    // below this the temperature terms are not observable
+
+struct driftModel {
+    bool valid;
+    int terms;              // 1 = constant rate, 3 = rate parabolic in temperature
+    double coef[3];         // RTC rate in s/s: coef[0] + coef[1]*dT + coef[2]*dT^2, dT = T - 25C
+    double outageRate;      // rate averaged over the recorded temperature history
+    double lastReset;       // system epoch of the last systohc, 0 if unknown
+    double span;            // seconds of history behind the fit
+    int samples;
+};
+
+// Offsets only mean something while NTP (or similar) keeps the system clock honest.
+bool isSystemClockSynced(){
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    int state = adjtimex(&tx);
+    return state != -1 && state != TIME_ERROR && (tx.status & STA_UNSYNC) == 0;
+}
+
+#if RTC_WITH_DRIFT_LOG
+// First readable thermal zone, in degrees C.
+int readBoardTemperature(double *tempC){
+    int zone;
+    for (zone = 0; zone < 16; zone++){
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/class/thermal/thermal_zone%d/temp", zone);
+
+        FILE *f = fopen(path, "r");
+        if (!f){
+            continue;
+        }
+
+        long milliC;
+        int res = fscanf(f, "%ld", &milliC);
+        fclose(f);
+        if (res == 1){
+            *tempC = milliC / 1000.0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void trimDriftLog(){
+    struct stat st;
+    if (stat(DRIFT_LOG_PATH, &st) < 0 || st.st_size <= DRIFT_LOG_MAX_BYTES){
+        return;
+    }
+
+    FILE *in = fopen(DRIFT_LOG_PATH, "r");
+    if (!in){
+        return;
+    }
+
+    char tmpPath[128];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", DRIFT_LOG_PATH);
+    FILE *out = fopen(tmpPath, "w");
+    if (!out){
+        fclose(in);
+        return;
+    }
+
+    //Keep the newer half, led by the last reset from the older one, the fit is only anchored by that.
+    char line[128];
+    char lastReset[128] = "";
+    while (ftell(in) < st.st_size / 2 && fgets(line, sizeof(line), in) != NULL){
+        if (line[0] == 'R'){
+            strcpy(lastReset, line);
+        }
+    }
+    fputs(lastReset, out);
+
+    while (fgets(line, sizeof(line), in) != NULL){
+        fputs(line, out);
+    }
+    fclose(in);
+    fclose(out);
+    rename(tmpPath, DRIFT_LOG_PATH);
+}
+
+void appendDriftLog(const char *line){
+#if RTC_WITH_TRACE
+    //A replayed RTC says nothing about this system.
+    if (traceReplayFile != NULL){
+        return;
+    }
+#endif
+    mkdir(DRIFT_LOG_DIR, 0755);
+    trimDriftLog();
+
+    FILE *f = fopen(DRIFT_LOG_PATH, "a");
+    if (!f){
+        return;
+    }
+    fputs(line, f);
+    fclose(f);
+}
+
+void recordDriftSample(const struct rtc_snapshot *snap){
+    double tempC;
+    if (!isSystemClockSynced() || readBoardTemperature(&tempC) != 0){
+        return;
+    }
+
+    char line[128];
+    snprintf(line, sizeof(line), "S %lld.%09d %.3f %.1f\n", (long long)snap->sampleSec, snap->sampleNsec, snap->offsetNsec / 1e9, tempC);
+    appendDriftLog(line);
+}
+
+void recordDriftReset(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char line[64];
+    snprintf(line, sizeof(line), "R %lld\n", (long long)now.tv_sec);
+    appendDriftLog(line);
+}
+
+// Solve the n x n normal equations in place, returns -1 if singular.
+int solveNormalEquations(double a[3][3], double b[3], int n, double *x){
+    int i;
+    int j;
+    int k;
+
+    for (i = 0; i < n; i++){
+        int pivot = i;
+        for (j = i + 1; j < n; j++){
+            if (fabs(a[j][i]) > fabs(a[pivot][i])){
+                pivot = j;
             }
-        }else{
-            printf("ERR: Failed to read the 'minutes' from the BQ32K chip!\n");
         }
-    } else {
-        printf("ERR: Failed to read the 'seconds' from the BQ32K chip!\n");
+        if (fabs(a[pivot][i]) < 1e-12){
+            return -1;
+        }
+        if (pivot != i){
+            for (k = 0; k < n; k++){
+                double t = a[i][k];
+                a[i][k] = a[pivot][k];
+                a[pivot][k] = t;
+            }
+            double t = b[i];
+            b[i] = b[pivot];
+            b[pivot] = t;
+        }
+        for (j = i + 1; j < n; j++){
+            double f = a[j][i] / a[i][i];
+            for (k = i; k < n; k++){
+                a[j][k] -= f * a[i][k];
+            }
+            b[j] -= f * b[i];
+        }
+    }
+
+    for (i = n - 1; i >= 0; i--){
+        double sum = b[i];
+        for (k = i + 1; k < n; k++){
+            sum -= a[i][k] * x[k];
+        }
+        x[i] = sum / a[i][i];
     }
+    return 0;
 }
 
-void setBQ32KTime(int fd, int seconds, int minutes, int hours, int day, int month, int year, int weekday){
-    uint8_t addr = BQ32K;
-    uint8_t regaddr = 0x00; // Register to read from
+// Least squares fit of the accumulated offset against the integrated temperature terms.
+// Each segment starts at a systohc (offset 0) or at its first sample, so no intercept is needed.
+void fitDriftModel(struct driftModel *model){
+    memset(model, 0, sizeof(*model));
 
-    if (fd < 0){
-        printf("i2c fd error!\n");
+    FILE *f = fopen(DRIFT_LOG_PATH, "r");
+    if (!f){
         return;
     }
 
-    int ones;
-    int tens;
+    double ata[3][3] = {{0}};
+    double atb[3] = {0};
+    double ata1 = 0.0;
+    double atb1 = 0.0;
+    double sumDT = 0.0;
+    double sumDT2 = 0.0;
+    double tempMin = 1000.0;
+    double tempMax = -1000.0;
+
+    bool inSegment = false;
+    bool fromReset = false;
+    double segStart = 0.0;
+    double baseOffset = 0.0;
+    double lastTime = 0.0;
+    double lastTemp = 0.0;
+    double integ[3] = {0};
+
+    char line[128];
+    while (fgets(line, sizeof(line), f) != NULL){
+        double t;
+        double offset;
+        double temp;
+
+        if (sscanf(line, "R %lf", &t) == 1){
+            model->lastReset = t;
+            inSegment = false;
+            fromReset = true;
+            segStart = t;
+            continue;
+        }
+        if (sscanf(line, "S %lf %lf %lf", &t, &offset, &temp) != 3){
+            continue;
+        }
+
+        double dT = temp - DRIFT_TURNOVER_TEMP;
+        sumDT += dT;
+        sumDT2 += dT * dT;
+        model->samples++;
+        if (temp < tempMin){
+            tempMin = temp;
+        }
+        if (temp > tempMax){
+            tempMax = temp;
+        }
+
+        if (!inSegment){
+            inSegment = true;
+            memset(integ, 0, sizeof(integ));
+            if (fromReset){
+                //Temperature before the first sample is unknown, assume it matched.
+                baseOffset = 0.0;
+                lastTime = segStart;
+                lastTemp = temp;
+            }else{
+                baseOffset = offset;
+                lastTime = t;
+                lastTemp = temp;
+                continue;
+            }
+        }
+
+        double dt = t - lastTime;
+        if (dt <= 0.0){
+            continue;
+        }
+        double meanDT = (temp + lastTemp) / 2.0 - DRIFT_TURNOVER_TEMP;
+        integ[0] += dt;
+        integ[1] += meanDT * dt;
+        integ[2] += meanDT * meanDT * dt;
+        model->span += dt;
+        lastTime = t;
+        lastTemp = temp;
+
+        double y = offset - baseOffset;
+        int i;
+        int j;
+        for (i = 0; i < 3; i++){
+            for (j = 0; j < 3; j++){
+                ata[i][j] += integ[i] * integ[j];
+            }
+            atb[i] += integ[i] * y;
+        }
+        ata1 += integ[0] * integ[0];
+        atb1 += integ[0] * y;
+        fromReset = false;
+    }
+    fclose(f);
+
+    if (model->samples < 4 || model->span < DRIFT_MIN_SPAN || ata1 <= 0.0){
+        return;
+    }
+
+    model->terms = 1;
+    model->coef[0] = atb1 / ata1;
+    if (tempMax - tempMin >= DRIFT_MIN_TEMP_RANGE){
+        double x[3];
+        if (solveNormalEquations(ata, atb, 3, x) == 0){
+            model->terms = 3;
+            memcpy(model->coef, x, sizeof(x));
+        }
+    }
+
+    //The rate is parabolic, so average it over the temperature history instead of using the mean temperature.
+    model->outageRate = model->coef[0] + model->coef[1] * (sumDT / model->samples) + model->coef[2] * (sumDT2 / model->samples);
+    model->valid = true;
+}
+
+// Predicted RTC error (RTC minus true time) accumulated since the last systohc.
+int64_t predictRTCErrorNs(time_t rtcEpoch){
+    struct driftModel model;
+    fitDriftModel(&model);
+    if (!model.valid || model.lastReset <= 0.0){
+        return 0;
+    }
+
+    double elapsed = (double)rtcEpoch - model.lastReset;
+    if (elapsed <= 0.0){
+        return 0;
+    }
+
+    double error = model.outageRate * elapsed;
+    printf("DRIFT: %.3f ppm over %.1f h (%s model, %d samples), correcting %.3f s\n", model.outageRate * 1e6, elapsed / 3600.0, model.terms == 3 ? "thermal" : "constant", model.samples, error);
+    return (int64_t)(error * 1e9);
+}
+#else
+// No drift log, the ISL1208 sync record is the only drift correction left.
+void recordDriftSample(const struct rtc_snapshot *snap){
+    (void)snap;
+}
+
+void recordDriftReset(){
+}
+
+void fitDriftModel(struct driftModel *model){
+    memset(model, 0, sizeof(*model));
+}
+
+int64_t predictRTCErrorNs(time_t rtcEpoch){
+    (void)rtcEpoch;
+    return 0;
+}
+#endif
+
+// Sync record kept inside the ISL1208, so hctosys can correct drift before any filesystem is mounted.
+// The alarm registers hold the last systohc time in their own BCD format (alarm left disabled), the user
+// SRAM holds the drift estimate and a CRC over the lot:
+//   0x0C-0x10 seconds, minutes, hours, date, month of the last systohc   0x11 weekday alarm, kept 0
+//   0x12 drift in 0.25 ppm steps (signed, -128 = no estimate yet)        0x13 CRC-8
+// The record is only used while ALME is clear, an armed alarm is never overwritten.
+const uint8_t ISL1208_REG_INT = 0x08;
+const uint8_t ISL1208_REG_ALARM = 0x0C;
+const uint8_t ISL1208_SYNC_RECORD_LEN = 8;
+const uint8_t ISL1208_INT_ALME = 0x40;
+const double SYNC_RECORD_PPM_STEP = 0.25;
+const int8_t SYNC_RECORD_NO_ESTIMATE = -128;   // systohc before the drift log had a model
+
+struct syncRecord {
+    bool valid;
+    time_t lastSync;        // RTC time of the last systohc
+    double driftPpm;
+};
+
+#if RTC_WITH_ISL1208
+uint8_t syncRecordCRC(const uint8_t *data, int len){
+    uint8_t crc = 0xA5; //Non-zero seed, so cleared registers never pass
+    int i;
+    int bit;
+    for (i = 0; i < len; i++){
+        crc ^= data[i];
+        for (bit = 0; bit < 8; bit++){
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+// regs holds 0x00-0x13 from one burst read.
+void decodeISL1208SyncRecord(const uint8_t *regs, int rtcYear, time_t rtcEpoch, struct syncRecord *record){
+    const uint8_t *rec = &regs[ISL1208_REG_ALARM];
+    memset(record, 0, sizeof(*record));
+
+    if ((regs[ISL1208_REG_INT] & ISL1208_INT_ALME) != 0){
+        return;
+    }
+    if (syncRecordCRC(rec, ISL1208_SYNC_RECORD_LEN - 1) != rec[7] || (int8_t)rec[6] == SYNC_RECORD_NO_ESTIMATE){
+        return;
+    }
+
+    int seconds = BCDtoInt(rec[0] & 0x7F);
+    int minutes = BCDtoInt(rec[1] & 0x7F);
+    int hours = BCDtoInt(rec[2] & 0x3F);
+    int day = BCDtoInt(rec[3] & 0x3F);
+    int month = BCDtoInt(rec[4] & 0x1F);
+
+    //The alarm has no year, the last systohc is the latest such date not after the RTC time.
+    time_t lastSync = rtcToEpoch(rtcYear, month, day, hours, minutes, seconds);
+    if (lastSync > rtcEpoch){
+        lastSync = rtcToEpoch(rtcYear - 1, month, day, hours, minutes, seconds);
+    }
+    if (lastSync == -1){
+        return;
+    }
+
+    record->valid = true;
+    record->lastSync = lastSync;
+    record->driftPpm = (int8_t)rec[6] * SYNC_RECORD_PPM_STEP;
+}
+
+#if !RTC_BOOT_MINIMAL
+int writeISL1208SyncRecord(int fd, int seconds, int minutes, int hours, int day, int month, double driftPpm){
+    uint8_t intReg;
+    if (i2c_reg_read_byte(fd, ISL1208, ISL1208_REG_INT, &intReg) != 0){
+        return -1;
+    }
+    if ((intReg & ISL1208_INT_ALME) != 0){
+        printf("WRN: ISL1208 alarm is armed, not storing the sync record\n");
+        return -1;
+    }
+
+    //NAN when there is no estimate, hctosys then goes to the drift log instead of correcting by 0 ppm.
+    double steps = isnan(driftPpm) ? SYNC_RECORD_NO_ESTIMATE : driftPpm / SYNC_RECORD_PPM_STEP;
+    if (steps > 127.0){
+        steps = 127.0;
+    }
+    if (steps < -127.0 && !isnan(driftPpm)){
+        steps = -127.0;
+    }
+
+    //Enable bits (bit 7) stay clear, so the alarm never matches on these values.
+    uint8_t regs[8];
+    regs[0] = intToBCD(seconds);
+    regs[1] = intToBCD(minutes);
+    regs[2] = intToBCD(hours);
+    regs[3] = intToBCD(day);
+    regs[4] = intToBCD(month);
+    regs[5] = 0x00;
+    regs[6] = (uint8_t)(int8_t)lround(steps);
+    regs[7] = syncRecordCRC(regs, ISL1208_SYNC_RECORD_LEN - 1);
+
+    if (i2c_reg_write_block(fd, ISL1208, ISL1208_REG_ALARM, regs, sizeof(regs)) != 0){
+        printf("ERR: Failed to write the sync record to the ISL1208 chip!\n");
+        return -1;
+    }
+    return 0;
+}
+
+#endif
+#endif
+
+// A valid record from the RTC wins, it needs no filesystem. Otherwise fall back to the drift log.
+int hctosysFromRTC(time_t rtcEpoch, const struct syncRecord *record){
+    if (rtcEpoch == -1){
+        printf("ERR: mktime() call failed!\n");
+        return -1;
+    }
+
+    int64_t correctionNs = 0;
+    if (record != NULL && record->valid){
+        double elapsed = (double)(rtcEpoch - record->lastSync);
+        double error = record->driftPpm * 1e-6 * elapsed;
+        printf("DRIFT: %.2f ppm over %.1f h (RTC sync record), correcting %.3f s\n", record->driftPpm, elapsed / 3600.0, error);
+        correctionNs = (int64_t)(error * 1e9);
+    }else{
+        correctionNs = predictRTCErrorNs(rtcEpoch);
+    }
+
+    int64_t target = (int64_t)rtcEpoch * 1000000000LL - correctionNs;
+    struct timeval tv;
+    tv.tv_sec = target / 1000000000LL;
+    tv.tv_usec = (target % 1000000000LL) / 1000;
+    if (tv.tv_usec < 0){
+        tv.tv_sec -= 1;
+        tv.tv_usec += 1000000;
+    }
+
+#if RTC_WITH_TRACE
+    if (traceReplayFile != NULL){
+        printf("RPL: settimeofday skipped\n");
+        printf("HCTOSYS OK\n");
+        return 0;
+    }
+#endif
+
+    RTC_PROBE2(settime_start, (long long)tv.tv_sec, (long)tv.tv_usec);
+    int64_t start = RTC_PROBE_ENABLED(settime_done) ? probeClockNs() : 0;
+    int res = settimeofday(&tv, NULL);
+    RTC_PROBE2(settime_done, res < 0 ? errno : 0, RTC_PROBE_ENABLED(settime_done) ? probeClockNs() - start : 0);
+
+    if (res < 0) {
+        printf("HCTOSYS FAIL\n");
+        return -1;
+    }
+
+    printf("HCTOSYS OK\n");
+    return 0;
+}
+
+// The long-running modes decode the RTC every second, so warnings go out when a condition shows up, not on every read.
+bool weekdayWarned = false;
+bool oscillatorWarned = false;
+
+bool warnOnChange(bool condition, bool *warned){
+    bool warn = condition && !*warned;
+    *warned = condition;
+    return warn;
+}
+
+#if RTC_WITH_ISL1208
+// Hours register to 0-23, the chip may be in 12h (bit 5 PM) or 24h (bit 7 MIL) mode.
+int decodeISL1208Hours(uint8_t RTChours){
+    bool isTwentyFourHours = false;
+    int hoursCalc;
+
+    // 24-hour check fix
+    if ((RTChours & 0x80) != 0){
+        isTwentyFourHours = true;
+    }else{
+        isTwentyFourHours = false;
+    }
+
+    // Hour extraction corrected
+    if (!isTwentyFourHours){
+        if ((RTChours & 0x20) != 0){
+            // PM
+            hoursCalc = BCDtoInt(RTChours & 0x1F);
+            if (hoursCalc != 12){
+                hoursCalc += 12;
+            }
+        }else{
+            // AM
+            hoursCalc = BCDtoInt(RTChours & 0x1F);
+            if (hoursCalc == 12){
+                hoursCalc = 0;
+            }
+        }
+    }else{
+        // Corrected: Keep bits 6:0 for 24h BCD
+        hoursCalc = BCDtoInt(RTChours & 0x7F);
+    }
+
+    return hoursCalc;
+}
+
+void processISL1208Time(uint8_t RTCseconds, uint8_t RTCminutes, uint8_t RTChours, uint8_t RTCweekday, uint8_t RTCday, uint8_t RTCmonth, uint8_t RTCyear, bool printTime, bool setTime, uint8_t RTC_StatusReg, const struct syncRecord *record, struct rtc_snapshot *snap){
+    //hwclock output: 2019-09-20 11:08:05.566357+00:00
+    int secondsCalc;
+    int minutesCalc;
+    int hoursCalc;
+    int dayCalc;
+    int monthCalc;
+    int yearCalc;
+    int weekdayCalc;
+
+    uint8_t ones;
+    uint8_t tens;
+
+    secondsCalc = BCDtoInt(RTCseconds);
+    minutesCalc = BCDtoInt(RTCminutes);
+
+    hoursCalc = decodeISL1208Hours(RTChours);
+
+    dayCalc = BCDtoInt(RTCday);
+    monthCalc = BCDtoInt(RTCmonth);
+    yearCalc = BCDtoInt(RTCyear) + 2000;
+    weekdayCalc = BCDtoInt(RTCweekday);
+
+    int dayOfWeekCalc = calculateDayOfWeek(dayCalc, monthCalc, yearCalc);
+    int isClockRunning = (RTCseconds & 0x10);
+
+    if (warnOnChange(dayOfWeekCalc != RTCweekday, &weekdayWarned)){
+        printf("WRN: RTC Weekday out of sync!\n");
+        printf("RTC Weekday: %d\n", RTCweekday);
+        printf("Calculated weekday: %d\n", dayOfWeekCalc);
+    }
+
+    if (warnOnChange(isClockRunning == 0, &oscillatorWarned)){
+        printf("WRN: RTC Oscillator has stopped!\n");
+    }
+
+    if (snap != NULL){
+        snap->chip = ISL1208;
+        snap->oscRunning = (RTC_StatusReg & 0x01) == 0; //RTCF set means the oscillator lost power
+        snap->year = yearCalc;
+        snap->month = monthCalc;
+        snap->day = dayCalc;
+        snap->hours = hoursCalc;
+        snap->minutes = minutesCalc;
+        snap->seconds = secondsCalc;
+        snap->weekday = weekdayCalc;
+        snap->rtcEpoch = rtcToEpoch(yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc);
+    }
+
+    if (printTime){
+        printf("RTC: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc);
+        printf("TYP: ISL1208\n");
+    }
+
+    if (setTime){
+        hctosysFromRTC(rtcToEpoch(yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc), record);
+    }
+}
+
+#endif
+
+#if RTC_WITH_BQ32K
+void processBQ32KTime(uint8_t RTCseconds, uint8_t RTCminutes, uint8_t RTChours, uint8_t RTCweekday, uint8_t RTCday, uint8_t RTCmonth, uint8_t RTCyear, bool printTime, bool setTime, struct rtc_snapshot *snap){
+    //hwclock output: 2019-09-20 11:08:05.566357+00:00
+
+    int secondsCalc;
+    int minutesCalc;
+    int hoursCalc;
+    int dayCalc;
+    int monthCalc;
+    int yearCalc;
+
+    uint8_t ones;
+    uint8_t tens;
+
+    ones = RTCseconds & 0x0F;
+    tens = (RTCseconds & 0x70) >> 4;
+    secondsCalc = ((10 * tens) + ones);
+
+    ones = RTCminutes & 0x0F;
+    tens = (RTCminutes & 0x70) >> 4;
+    minutesCalc = ((10 * tens) + ones);
+
+    ones = RTChours & 0x0F;
+    tens = (RTChours & 0x30) >> 4;
+    hoursCalc = ((10 * tens) + ones);
+
+    ones = RTCday & 0x0F;
+    tens = (RTCday & 0x30) >> 4;
+    dayCalc = ((10 * tens) + ones);
+
+    ones = RTCmonth & 0x0F;
+    tens = (RTCmonth & 0x10) >> 4;
+    monthCalc = ((10 * tens) + ones);
+
+    ones = RTCyear & 0x0F;
+    tens = (RTCyear & 0xF0) >> 4;
+    yearCalc = ((10 * tens) + ones) + 2000;
+
+
+    // printf("Calculated hours: %d\n", hoursCalc);
+    // printf("Calculated minutes: %d\n", minutesCalc);
+    // printf("Calculated seconds: %d\n", secondsCalc);
+    // printf("Calculated day: %d\n", dayCalc);
+    // printf("Calculated month: %d\n", monthCalc);
+    // printf("Calculated year: %d\n", yearCalc);
+
+
+    int dayOfWeekCalc = calculateDayOfWeek(dayCalc, monthCalc, yearCalc);
+    int isClockRunning = (RTCseconds & 0x80);
+
+
+    dayOfWeekCalc += 1;
+    if (warnOnChange(dayOfWeekCalc != RTCweekday, &weekdayWarned)){
+        printf("WRN: RTC Weekday out of sync!\n");
+        printf("RTC Weekday: %d\n", RTCweekday);
+        printf("Calculated weekday: %d\n", dayOfWeekCalc);
+    }
+
+    //hwclock output: 2019-09-20 11:08:05.566357+00:00
+    if (warnOnChange(isClockRunning == 1, &oscillatorWarned)){
+        printf("WRN: RTC Oscillator has stopped!\n");
+    }
+
+    if (snap != NULL){
+        snap->chip = BQ32K;
+        snap->oscRunning = (RTCseconds & 0x80) == 0; //STOP bit
+        snap->year = yearCalc;
+        snap->month = monthCalc;
+        snap->day = dayCalc;
+        snap->hours = hoursCalc;
+        snap->minutes = minutesCalc;
+        snap->seconds = secondsCalc;
+        snap->weekday = RTCweekday;
+        snap->rtcEpoch = rtcToEpoch(yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc);
+    }
+
+    if (printTime){
+        printf("RTC: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc);
+        printf("TYP: BQ32K\n");
+    }
+
+    //Set the system time from the RTC!
+    if (setTime){
+        hctosysFromRTC(rtcToEpoch(yearCalc, monthCalc, dayCalc, hoursCalc, minutesCalc, secondsCalc), NULL);
+    }
+}
+
+#endif
+
+#if RTC_WITH_ISL1208
+int readISL1208(int fd, bool printTime, bool setSystemTime, struct rtc_snapshot *snap){
+    uint8_t addr = ISL1208;
+    uint8_t regs[0x14]; // 0x00 seconds, 0x01 minutes, 0x02 hours, 0x03 day, 0x04 month, 0x05 year, 0x06 weekday, 0x07 status
+                        // 0x08-0x13 control, alarm and user SRAM, only read for hctosys (sync record)
+    uint8_t len = setSystemTime ? sizeof(regs) : 8;
+
+    struct timespec readStart;
+    struct timespec readEnd;
+
+    //One burst read, so the registers can not tear across a seconds rollover.
+    clock_gettime(CLOCK_REALTIME, &readStart);
+    if (i2c_reg_read_block(fd, addr, 0x00, regs, len) != 0){
+        printf("ERR: Failed to read the time registers from the ISL1208 chip!\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &readEnd);
+
+    struct syncRecord record;
+    memset(&record, 0, sizeof(record));
+    if (setSystemTime){
+        int year = BCDtoInt(regs[5]) + 2000;
+        time_t rtcEpoch = rtcToEpoch(year, BCDtoInt(regs[4]), BCDtoInt(regs[3]), decodeISL1208Hours(regs[2]), BCDtoInt(regs[1]), BCDtoInt(regs[0]));
+        decodeISL1208SyncRecord(regs, year, rtcEpoch, &record);
+    }
+
+    processISL1208Time(regs[0], regs[1], regs[2], regs[6], regs[3], regs[4], regs[5], printTime, setSystemTime, regs[7], &record, snap);
+    if (snap != NULL){
+        memcpy(snap->regs, regs, 8);
+        snap->regCount = 8;
+        stampSnapshot(snap, &readStart, &readEnd);
+    }
+    return 0;
+}
+
+#endif
+
+#if RTC_WITH_BQ32K
+int readBQ32K(int fd, bool printTime, bool setSystemTime, struct rtc_snapshot *snap){
+    uint8_t addr = BQ32K;
+    uint8_t regs[7];    // 0x00 seconds, 0x01 minutes, 0x02 hours, 0x03 weekday, 0x04 day, 0x05 month, 0x06 year
+
+    struct timespec readStart;
+    struct timespec readEnd;
+
+    clock_gettime(CLOCK_REALTIME, &readStart);
+    if (i2c_reg_read_block(fd, addr, 0x00, regs, sizeof(regs)) != 0){
+        printf("ERR: Failed to read the time registers from the BQ32K chip!\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &readEnd);
+
+    processBQ32KTime(regs[0], regs[1], regs[2], regs[3], regs[4], regs[5], regs[6], printTime, setSystemTime, snap);
+    if (snap != NULL){
+        memcpy(snap->regs, regs, sizeof(regs));
+        snap->regCount = sizeof(regs);
+        stampSnapshot(snap, &readStart, &readEnd);
+    }
+    return 0;
+}
+
+#endif
+
+// Only the chips compiled in.
+int readRTC(int fd, int chip, bool printTime, bool setSystemTime, struct rtc_snapshot *snap){
+#if RTC_WITH_ISL1208
+    if (chip == ISL1208){
+        return readISL1208(fd, printTime, setSystemTime, snap);
+    }
+#endif
+#if RTC_WITH_BQ32K
+    if (chip == BQ32K){
+        return readBQ32K(fd, printTime, setSystemTime, snap);
+    }
+#endif
+    return -1;
+}
+
+#if RTC_WITH_BQ32K && !RTC_BOOT_MINIMAL
+int setBQ32KTime(int fd, int seconds, int minutes, int hours, int day, int month, int year, int weekday){
+    uint8_t addr = BQ32K;
+    uint8_t regaddr = 0x00; // Register to read from
+
+    if (fd < 0){
+        printf("i2c fd error!\n");
+        return -1;
+    }
+
+    int ones;
+    int tens;
+
+    //Convert the times back to the appropiate format...
+    int rtcSeconds;
+    int rtcMinutes;
+    int rtcHours;
+    int rtcDay;
+    int rtcMonth;
+    int rtcYear;
+    int rtcWeekday;
+
+    ones = 0;
+    tens = 0;
+    seconds %= 60;
+    ones = seconds % 10;
+    tens = ( seconds / 10 ) << 4;
+    rtcSeconds = tens | ones;
+
+    ones = 0;
+    tens = 0;
+    minutes %= 60;
+    ones = minutes % 10;
+    tens = ( minutes / 10 ) << 4;
+    rtcMinutes = tens | ones;
+
+    ones = 0;
+    tens = 0;
+    hours %= 24;
+    ones = hours % 10;
+    tens = ( hours / 10 ) << 4;
+    rtcHours = tens | ones;
+
+    ones = 0;
+    tens = 0;
+    day %= 32;
+    if (day == 0){
+        day = 1;
+    }
+    ones = day % 10;
+    tens = ( day / 10 ) << 4;
+    rtcDay = tens | ones;
+
+
+    ones = 0;
+    tens = 0;
+    month %= 13;
+    if (month == 0){
+        month = 1;
+    }
+    ones = month % 10;
+    tens = ( month / 10 ) << 4;
+    rtcMonth = tens | ones;
+
+    ones = 0;
+    tens = 0;
+    year %= 100;
+    ones = year % 10;
+    tens = ( year / 10 ) << 4;
+    rtcYear = tens | ones;
+
+    weekday %= 8;
+    if (weekday == 0){
+        weekday = 1;
+    }
+    rtcWeekday = weekday + 1;
+
+    uint8_t rtcStatus;
+
+    uint8_t regs[7] = { rtcSeconds, rtcMinutes, rtcHours, rtcWeekday, rtcDay, rtcMonth, rtcYear };
+
+    //printf("Setting BQ32K time to: %02d:%02d:%02d %02d/%02d/%02d %02d\n", hours, minutes, seconds, day, month, year, weekday);
+    if (i2c_reg_write_block(fd, addr, regaddr, regs, sizeof(regs)) != 0){
+        printf("ERR: Failed to write the time registers to the BQ32K chip!\n");
+        return -1;
+    }
+
+    if (i2c_reg_read_byte(fd, addr, regaddr, &rtcStatus) == 0){
+        if ((rtcStatus & 0x80) == 1){
+            printf("WRN: RTC Oscillator has stopped, starting...\n");
+            rtcStatus &= 0x7F;
+            if (i2c_reg_write_byte(fd, addr, regaddr, rtcStatus) == 0){
+                printf("SYSTOHC OK\n");
+                //printf("BQ32K time successfully set to: %04d-%02d-%02d %02d:%02d:%02d\n", (2000 + year), month, day, hours, minutes, seconds);
+            }else{
+                printf("BQ32K: Failed to start the RTC oscillator!\n");
+            }
+        }else{
+            printf("SYSTOHC OK\n");
+            //printf("BQ32K time successfully set to: %04d-%02d-%02d %02d:%02d:%02d\n", (2000 +year), month, day, hours, minutes, seconds);
+        }
+    }else{
+        printf("ERR: Failed to read the 'status register' from the BQ32K chip!\n");
+    }
+    return 0;
+}
+
+#endif
+
+#if RTC_WITH_ISL1208 && !RTC_BOOT_MINIMAL
+void enableISL1208WRTCBit(int fd){
+    uint8_t addr = ISL1208;
+    uint8_t regaddr = 0x07; // Register to write to. (Seconds)
+
+    if (fd < 0){
+        printf("i2c fd error!\n");
+        return;
+    }
+
+    uint8_t rtcStatus;
+
+    if (i2c_reg_read_byte(fd, addr, regaddr, &rtcStatus) == 0) {
+        rtcStatus |= 0x10; //Set the WRTC bit.
+        if (i2c_reg_write_byte(fd, addr, regaddr, rtcStatus) == 0){
+            //printf("ISL1208 WRTC bit successfully set!\n");
+        }else{
+            printf("ERR: Failed to write the 'status register' to the ISL1208 chip!\n");
+        }
+    }else{
+        printf("ERR: Failed to read the 'status register' from the ISL1208 chip!\n");
+    }
+
+}
+
+int setISL1208Time(int fd, int seconds, int minutes, int hours, int day, int month, int year, int weekday){
+    //According to the datasheet, I will have to write a WRTC bit on register 0x07, value 0x10 -> 0001 0000.
+    //This is to allow the RTC time setting.
+ 
+
+    uint8_t addr = ISL1208;
+    uint8_t regaddr = 0x00; // Register to write to. (Seconds)
+
+    if (fd < 0){
+        printf("i2c fd error!\n");
+        return -1;
+    }
+
+    enableISL1208WRTCBit(fd);
+
+    uint8_t rtcSeconds;
+    uint8_t rtcMinutes;
+    uint8_t rtcHours;
+    uint8_t rtcDay;
+    uint8_t rtcMonth;
+    uint8_t rtcYear;
+    uint8_t rtcWeekday;
+
+    rtcSeconds = intToBCD(seconds);
+    rtcMinutes = intToBCD(minutes);
+
+    uint8_t rtcHoursBCD = intToBCD(hours); //Force 24h mode...
+    rtcHours = rtcHoursBCD | 0x80; //Set the 24h bit.
+
+    rtcDay = intToBCD(day);
+    rtcMonth = intToBCD(month);
+    rtcYear = intToBCD(year - 2000);
+    rtcWeekday = intToBCD(weekday);
+
+    uint8_t regs[7] = { rtcSeconds, rtcMinutes, rtcHours, rtcDay, rtcMonth, rtcYear, rtcWeekday };
+
+    if (i2c_reg_write_block(fd, addr, regaddr, regs, sizeof(regs)) == 0){
+        printf("SYSTOHC OK\n");
+        //printf("ISL1208 time successfully set to: %04d-%02d-%02d %02d:%02d:%02d\n", year, month, day, hours, minutes, seconds);
+        return 0;
+    }else{
+        printf("ERR: Failed to write the time registers to the ISL1208 chip!\n");
+        return -1;
+    }
+}
+
+#endif
+
+#if !RTC_BOOT_MINIMAL
+// Writes a local time into the RTC, plus the sync record on the ISL1208. The drift log restarts from here.
+int writeRTCTime(int fd, int chip, const struct tm *tm){
+    int seconds = tm->tm_sec;
+    int minutes = tm->tm_min;
+    int hours = tm->tm_hour;
+    int day = tm->tm_mday;
+    int month = tm->tm_mon + 1;
+    int year = tm->tm_year + 1900;
+    int weekday = calculateDayOfWeek(day, month, year);
+    int res = -1;
+
+#if RTC_WITH_ISL1208
+    if (chip == ISL1208){
+        res = setISL1208Time(fd, seconds, minutes, hours, day, month, year, weekday);
+        if (res == 0){
+            struct driftModel model;
+            fitDriftModel(&model);
+            writeISL1208SyncRecord(fd, seconds, minutes, hours, day, month, model.valid ? model.outageRate * 1e6 : NAN);
+        }
+    }
+#endif
+
+#if RTC_WITH_BQ32K
+    if (chip == BQ32K){
+        res = setBQ32KTime(fd, seconds, minutes, hours, day, month, year, weekday);
+    }
+#endif
+
+    if (res == 0){
+        recordDriftReset();
+    }
+    return res;
+}
+#endif
+
+void printSysTime(){
+    int sysSeconds;
+    int sysMinutes;
+    int sysHours;
+    int sysDay;
+    int sysMonth;
+    int sysYear;
+
+    //Get time system time
+    time_t currentTime;
+    time(&currentTime);
+
+    // Convert to local time format
+    struct tm *localTime = localtime(&currentTime);
+    sysSeconds = localTime->tm_sec;
+    sysMinutes = localTime->tm_min;
+    sysHours = localTime->tm_hour;
+    sysDay = localTime->tm_mday;
+    sysMonth = localTime->tm_mon + 1;
+    sysYear = localTime->tm_year + 1900;
+
+    // Print the local time
+    printf("SYS: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", sysYear, sysMonth, sysDay, sysHours, sysMinutes, sysSeconds);
+}
+
+// Instances on the same bus (boot scripts, cron, dispatcher hooks, daemons) take turns through an advisory
+// flock on a per-bus lock file, held across probe, unbind/bind and every transfer sequence.
+int busLockFd = -1;
+
+int openBusLock(){
+    char path[64];
+    snprintf(path, sizeof(path), "/run/rtcsynctool-i2c-%d.lock", i2cBus);
+
+    busLockFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (busLockFd < 0){
+        printf("WRN: FAILED TO OPEN BUS LOCK %s: %s, running unlocked\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Returns true if another instance held the bus and we had to wait for it.
+bool lockBus(){
+    if (busLockFd < 0 || flock(busLockFd, LOCK_EX | LOCK_NB) == 0){
+        return false;
+    }
+
+    while (flock(busLockFd, LOCK_EX) < 0 && errno == EINTR){
+    }
+    //Whoever had the bus may have moved the mux.
+    if (muxAddr >= 0){
+        muxSelected = -1;
+    }
+    return true;
+}
+
+void unlockBus(){
+    if (busLockFd < 0){
+        return;
+    }
+    flock(busLockFd, LOCK_UN);
+}
+
+#if RTC_WITH_DAEMONS
+void printSnapshot(const struct rtc_snapshot *snap){
+    printf("RTC: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", snap->year, snap->month, snap->day, snap->hours, snap->minutes, snap->seconds);
+    printf("TYP: %s\n", snap->chip == ISL1208 ? "ISL1208" : "BQ32K");
+}
+
+// The last result on each bus lives in its lock file, in the snapshot page layout. It is only written and read
+// with the lock held, so it needs no seqlock, and it works without a publisher.
+void storeBusResult(const struct rtc_snapshot *snap){
+    if (busLockFd < 0){
+        return;
+    }
+
+    struct rtc_snapshot_page record;
+    memset(&record, 0, sizeof(record));
+    record.magic = RTC_SNAPSHOT_MAGIC;
+    record.version = RTC_SNAPSHOT_VERSION;
+    record.snap = *snap;
+    if (pwrite(busLockFd, &record, sizeof(record), 0) != (ssize_t)sizeof(record)){
+        printf("WRN: FAILED TO STORE THE RESULT FOR OTHER INSTANCES: %s\n", strerror(errno));
+    }
+}
+
+// The last result on this bus, if its bus read started after waitStart.
+bool readSharedSnapshot(const struct timespec *waitStart, struct rtc_snapshot *snap){
+    struct rtc_snapshot_page record;
+    if (busLockFd < 0 || pread(busLockFd, &record, sizeof(record), 0) != (ssize_t)sizeof(record)){
+        return false;
+    }
+    if (record.magic != RTC_SNAPSHOT_MAGIC || record.version != RTC_SNAPSHOT_VERSION){
+        return false;
+    }
+    *snap = record.snap;
+
+    int64_t sampleNs = snap->sampleSec * 1000000000LL + snap->sampleNsec - snap->readCostNsec / 2;
+    return sampleNs >= timespecToNs(waitStart);
+}
+
+// A get that had to wait for the bus can use what the instance before it read, if that read started after we
+// began waiting. Reads are coalesced this way, writes never are.
+bool useSharedSnapshot(const struct timespec *waitStart){
+    struct rtc_snapshot snap;
+    if (!readSharedSnapshot(waitStart, &snap)){
+        return false;
+    }
+
+    printSysTime();
+    printSnapshot(&snap);
+    printf("SHR: result shared from a concurrent read\n");
+    return true;
+}
+
+#endif
+
+#if !RTC_BOOT_MINIMAL
+// The offset read of systohc goes through the same snapshot as get: after waiting for the bus, a read of the same
+// chip that started after we began waiting is used instead of another one.
+int readRTCShared(int fd, int chip, bool waited, const struct timespec *waitStart, struct rtc_snapshot *snap){
+#if RTC_WITH_DAEMONS
+    if (waited && readSharedSnapshot(waitStart, snap) && snap->chip == chip){
+        printSnapshot(snap);
+        printf("SHR: result shared from a concurrent read\n");
+        return 0;
+    }
+#else
+    (void)waited;
+    (void)waitStart;
+#endif
+    return readRTC(fd, chip, true, false, snap);
+}
+#endif
+
+void printBusReport(){
+    printf("BUS: %s, %lld us/read\n", i2cXferName(i2cXferMode), (long long)(lastReadCostNs / 1000));
+}
+
+#if RTC_WITH_DAEMONS
+
+void handleStopSignal(int sig){
+    (void)sig;
+    keepRunning = 0;
+}
+
+void installStopHandlers(){
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleStopSignal; //No SA_RESTART, so sleeps return early on a signal
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+struct rtc_snapshot_page *openSnapshotPage(){
+    int fd = shm_open(RTC_SNAPSHOT_SHM_NAME, O_CREAT | O_RDWR, 0644);
+    if (fd < 0){
+        printf("ERR: FAILED TO OPEN SNAPSHOT SHM: %s\n", strerror(errno));
+        return NULL;
+    }
+    fchmod(fd, 0644);
+
+    if (ftruncate(fd, sizeof(struct rtc_snapshot_page)) < 0){
+        printf("ERR: FAILED TO SIZE SNAPSHOT SHM: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, sizeof(struct rtc_snapshot_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        printf("ERR: FAILED TO MAP SNAPSHOT SHM: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    struct rtc_snapshot_page *page = (struct rtc_snapshot_page *)map;
+    if (page->magic != RTC_SNAPSHOT_MAGIC || page->version != RTC_SNAPSHOT_VERSION){
+        memset(page, 0, sizeof(*page));
+        page->version = RTC_SNAPSHOT_VERSION;
+        __atomic_store_n(&page->magic, RTC_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+    }
+    return page;
+}
+
+// Seqlock write side: bump to odd, copy, bump back to even. A writer that died mid-update left seq odd, it stays
+// odd for the copy instead of going even too early.
+void publishSnapshot(struct rtc_snapshot_page *page, const struct rtc_snapshot *snap){
+    uint32_t seq = page->seq | 1;
+
+    __atomic_store_n(&page->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&page->snap, snap, sizeof(*snap));
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Sleep until the next full second of the system clock, so each sample sits on a fresh RTC second.
+void sleepToNextSecond(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct timespec wait;
+    wait.tv_sec = 0;
+    wait.tv_nsec = 1000000000L - now.tv_nsec;
+    nanosleep(&wait, NULL);
+}
+
+int runPublishLoop(int fd, int chip){
+    struct rtc_snapshot_page *page = openSnapshotPage();
+    if (page == NULL){
+        return 1;
+    }
+
+    printf("PUB: shm %s, %zu bytes\n", RTC_SNAPSHOT_SHM_NAME, sizeof(struct rtc_snapshot_page));
+    installStopHandlers();
+
+    bool reported = false;
+    int64_t lastDriftSample = 0;
+    unlockBus();
+    while (keepRunning){
+        struct rtc_snapshot snap;
+        int res = -1;
+        memset(&snap, 0, sizeof(snap));
+
+        lockBus();
+        res = readRTC(fd, chip, false, false, &snap);
+        if (res == 0){
+            storeBusResult(&snap);
+        }
+        unlockBus();
+
+        if (res == 0){
+            if (!reported){
+                printBusReport();
+                reported = true;
+            }
+            publishSnapshot(page, &snap);
+
+            if (snap.sampleSec - lastDriftSample >= DRIFT_SAMPLE_INTERVAL){
+                recordDriftSample(&snap);
+                lastDriftSample = snap.sampleSec;
+            }
+        }
+
+        sleepToNextSecond();
+    }
+
+    lockBus();
+    rtc_snapshot_close(page);
+    return 0;
+}
+
+void sleepUntilNs(int64_t targetNs){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    int64_t waitNs = targetNs - timespecToNs(&now);
+    if (waitNs <= 0){
+        return;
+    }
+
+    struct timespec wait;
+    wait.tv_sec = waitNs / 1000000000LL;
+    wait.tv_nsec = waitNs % 1000000000LL;
+    nanosleep(&wait, NULL);
+}
+
+// Find the rollover roughly with a read every ROLLOVER_COARSE_STEP_NS, so a cold start costs ~50 reads rather than
+// a second of back to back polling. *earliestNs is the last read before the change, the rollover is just after it.
+const int64_t ROLLOVER_COARSE_STEP_NS = 20000000LL;
+
+int findRTCRollover(int fd, int chip, int64_t *earliestNs){
+    struct timespec prevStart;
+    struct timespec curStart;
+    uint8_t prev;
+    uint8_t cur;
+
+    clock_gettime(CLOCK_REALTIME, &prevStart);
+    if (i2c_reg_read_byte(fd, chip, 0x00, &prev) != 0){
+        return -1;
+    }
+
+    int64_t deadline = timespecToNs(&prevStart) + 1200000000LL;
+    while (keepRunning){
+        sleepUntilNs(timespecToNs(&prevStart) + ROLLOVER_COARSE_STEP_NS);
+        clock_gettime(CLOCK_REALTIME, &curStart);
+        if (i2c_reg_read_byte(fd, chip, 0x00, &cur) != 0){
+            return -1;
+        }
+        if ((cur & 0x7F) != (prev & 0x7F)){
+            *earliestNs = timespecToNs(&prevStart);
+            return 0;
+        }
+        if (timespecToNs(&curStart) > deadline){
+            printf("ERR: RTC SECONDS DID NOT ROLL OVER, OSCILLATOR STOPPED?\n");
+            return -1;
+        }
+        prev = cur;
+        prevStart = curStart;
+    }
+    return -1;
+}
+
+// The RTC only counts whole seconds, but the moment the seconds register changes pins its phase much finer.
+// Poll the seconds register until it rolls over, then burst read the time of the second that just started.
+// *rolloverNs is the system time (CLOCK_REALTIME) of the rollover, +-*uncertaintyNs.
+int measureRTCRollover(int fd, int chip, struct rtc_snapshot *snap, int64_t *rolloverNs, int64_t *uncertaintyNs){
+    struct timespec prevStart;
+    struct timespec curStart;
+    struct timespec curEnd;
+    uint8_t prev;
+    uint8_t cur;
+
+    clock_gettime(CLOCK_REALTIME, &prevStart);
+    if (i2c_reg_read_byte(fd, chip, 0x00, &prev) != 0){
+        return -1;
+    }
+
+    int64_t deadline = timespecToNs(&prevStart) + 1200000000LL;
+    while (keepRunning){
+        clock_gettime(CLOCK_REALTIME, &curStart);
+        if (i2c_reg_read_byte(fd, chip, 0x00, &cur) != 0){
+            return -1;
+        }
+        clock_gettime(CLOCK_REALTIME, &curEnd);
+
+        //Bit 7 is the BQ32K STOP flag, not part of the count.
+        if ((cur & 0x7F) != (prev & 0x7F)){
+            break;
+        }
+        if (timespecToNs(&curEnd) > deadline){
+            printf("ERR: RTC SECONDS DID NOT ROLL OVER, OSCILLATOR STOPPED?\n");
+            return -1;
+        }
+        prev = cur;
+        prevStart = curStart;
+    }
+    if (!keepRunning){
+        return -1;
+    }
+
+    //The rollover happened somewhere between the start of the last old read and the end of the first new one.
+    int64_t earliest = timespecToNs(&prevStart);
+    int64_t latest = timespecToNs(&curEnd);
+    *rolloverNs = earliest + (latest - earliest) / 2;
+    *uncertaintyNs = (latest - earliest) / 2;
+
+    memset(snap, 0, sizeof(*snap));
+    int res = readRTC(fd, chip, false, false, snap);
+    if (res != 0 || (snap->regs[0] & 0x7F) != (cur & 0x7F)){
+        return -1;
+    }
+    return 0;
+}
+
+// NTP shared memory refclock segment, as read by ntpd's SHM driver and chrony's "refclock SHM".
+struct shmTime {
+    int mode;               // 1: reader checks count before and after reading
+    volatile int count;
+    time_t clockTimeStampSec;
+    int clockTimeStampUSec;
+    time_t receiveTimeStampSec;
+    int receiveTimeStampUSec;
+    int leap;
+    int precision;
+    int nsamples;
+    volatile int valid;
+    unsigned clockTimeStampNSec;
+    unsigned receiveTimeStampNSec;
+    int dummy[8];
+};
+
+const key_t NTP_SHM_KEY = 0x4e545030; // "NTP0", plus the unit number
+
+struct shmTime *openNtpShm(int unit){
+    //Units 0 and 1 are root only, same as ntpd and chrony expect.
+    int id = shmget(NTP_SHM_KEY + unit, sizeof(struct shmTime), IPC_CREAT | (unit < 2 ? 0600 : 0666));
+    if (id < 0){
+        printf("ERR: FAILED TO GET NTP SHM UNIT %d: %s\n", unit, strerror(errno));
+        return NULL;
+    }
+
+    void *shm = shmat(id, NULL, 0);
+    if (shm == (void *)-1){
+        printf("ERR: FAILED TO ATTACH NTP SHM UNIT %d: %s\n", unit, strerror(errno));
+        return NULL;
+    }
+    return (struct shmTime *)shm;
+}
+
+void publishNtpSample(struct shmTime *shm, time_t rtcEpoch, int64_t rolloverNs, int precision){
+    shm->valid = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    shm->count++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    shm->mode = 1;
+    shm->clockTimeStampSec = rtcEpoch;
+    shm->clockTimeStampUSec = 0;
+    shm->clockTimeStampNSec = 0;
+    shm->receiveTimeStampSec = (time_t)(rolloverNs / 1000000000LL);
+    shm->receiveTimeStampUSec = (int)((rolloverNs % 1000000000LL) / 1000);
+    shm->receiveTimeStampNSec = (unsigned)(rolloverNs % 1000000000LL);
+    shm->leap = 0;
+    shm->precision = precision;
+    shm->nsamples = 3;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    shm->count++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    shm->valid = 1;
+}
+
+// log2 of the uncertainty in seconds, rounded up
+int precisionFromNs(int64_t uncertaintyNs){
+    int precision = -30;
+    while (precision < 0 && (1e9 / (double)(1LL << -precision)) < (double)uncertaintyNs){
+        precision++;
+    }
+    return precision;
+}
+
+int runRefclockLoop(int fd, int chip, int unit){
+    struct shmTime *shm = openNtpShm(unit);
+    if (shm == NULL){
+        return 1;
+    }
+
+    printf("REF: NTP SHM unit %d (key 0x%08x)\n", unit, NTP_SHM_KEY + unit);
+    installStopHandlers();
+
+    bool reported = false;
+    int64_t nextRollover = 0;
+    unlockBus();
+    while (keepRunning){
+        struct rtc_snapshot snap;
+        int64_t rolloverNs;
+        int64_t uncertaintyNs;
+        int res;
+
+        //Sleep until just before the expected rollover instead of polling the bus for a whole second.
+        if (nextRollover == 0){
+            int64_t earliestNs;
+            lockBus();
+            res = findRTCRollover(fd, chip, &earliestNs);
+            unlockBus();
+            if (res != 0){
+                sleepToNextSecond();
+                continue;
+            }
+            nextRollover = earliestNs + 1000000000LL;
+        }
+        sleepUntilNs(nextRollover - 5000000LL - 4 * lastReadCostNs);
+
+        lockBus();
+        res = measureRTCRollover(fd, chip, &snap, &rolloverNs, &uncertaintyNs);
+        unlockBus();
+        if (res != 0){
+            nextRollover = 0;
+            sleepToNextSecond();
+            continue;
+        }
+
+        int precision = precisionFromNs(uncertaintyNs);
+        publishNtpSample(shm, (time_t)snap.rtcEpoch, rolloverNs, precision);
+        nextRollover = rolloverNs + 1000000000LL;
+
+        if (!reported){
+            printf("REF: RTC phase %+.6f s, +-%lld us, precision %d\n", (snap.rtcEpoch * 1000000000LL - rolloverNs) / 1e9, (long long)(uncertaintyNs / 1000), precision);
+            reported = true;
+        }
+    }
+
+    lockBus();
+    shmdt((void *)shm);
+    return 0;
+}
+
+// Holdover steering: keep the system clock on the RTC with a PI loop on the kernel frequency, no steps.
+// The offset comes from the seconds rollover measurement, so it is good to about a millisecond.
+// The loop stays out of the way whenever an NTP daemon has the clock synced.
+struct steerParams {
+    double kp;              // 1/s, phase to frequency
+    double ki;              // 1/s^2, integrated phase to frequency
+    double interval;        // seconds between measurements
+    double slewLimit;       // offsets beyond this are slewed with ADJ_OFFSET_SINGLESHOT first
+    double maxPpm;          // kernel frequency limit
+};
+
+struct steerStats {
+    double startTime;
+    double convergedAfter;  // seconds to stay within the lock window, -1 until then
+    double jitterRms;       // offset RMS over the recent samples once converged
+    double lastOffset;
+    double freqPpm;
+    int samples;
+};
+
+// The real clock for the loop, and a simulated one for steersim.
+struct steerClock {
+    void *ctx;
+    int (*measure)(void *ctx, double *offset, double *uncertainty, double *now); // offset = system - RTC, seconds
+    int (*setFrequency)(void *ctx, double ppm);     // correction on top of the base frequency
+    int (*slew)(void *ctx, double offset);
+    bool (*externallySynced)(void *ctx);
+    void (*wait)(void *ctx, double seconds);
+};
+
+const double STEER_LOCK_WINDOW = 0.002;     // seconds
+const int STEER_LOCK_SAMPLES = 8;
+const int STEER_JITTER_SAMPLES = 32;
+
+void defaultSteerParams(struct steerParams *params){
+    //Critically damped with a 256s time constant.
+    double tau = 256.0;
+    params->kp = 2.0 / tau;
+    params->ki = 1.0 / (tau * tau);
+    params->interval = 4.0;
+    params->slewLimit = 0.5;
+    params->maxPpm = 500.0;
+}
+
+bool isSteerOption(const char *arg){
+    return strncmp(arg, "kp=", 3) == 0 || strncmp(arg, "ki=", 3) == 0 || strncmp(arg, "interval=", 9) == 0;
+}
+
+// NAME=NUMBER, the whole value has to be a finite number.
+int parseDoubleOption(const char *arg, double *value){
+    const char *text = strchr(arg, '=') + 1;
+    char *end;
+    double parsed = strtod(text, &end);
+    if (end == text || *end != '\0' || !isfinite(parsed)){
+        printf("ERR: BAD NUMBER IN %s\n", arg);
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+// kp=, ki=, interval= for steer and steersim.
+int parseSteerOption(const char *arg, struct steerParams *params){
+    double value;
+    if (parseDoubleOption(arg, &value) != 0){
+        return -1;
+    }
+
+    if (strncmp(arg, "kp=", 3) == 0){
+        params->kp = value;
+    }else if (strncmp(arg, "ki=", 3) == 0){
+        params->ki = value;
+    }else{
+        params->interval = value;
+    }
+    return 0;
+}
+
+// Keep the gains where the loop settles instead of ringing: a proportional step of at most a quarter of the
+// offset per interval, and an integral term no stronger than critically damped times four.
+int checkSteerParams(const struct steerParams *params){
+    if (params->interval < 1.0 || params->interval > 64.0){
+        printf("ERR: STEER INTERVAL MUST BE 1 TO 64 S\n");
+        return -1;
+    }
+    if (params->kp <= 0.0 || params->kp * params->interval > 0.25){
+        printf("ERR: STEER KP MUST BE ABOVE 0 AND AT MOST %.6f WITH A %.1f S INTERVAL\n", 0.25 / params->interval, params->interval);
+        return -1;
+    }
+    if (params->ki <= 0.0 || params->ki > params->kp * params->kp){
+        printf("ERR: STEER KI MUST BE ABOVE 0 AND AT MOST KP^2 (%.8f)\n", params->kp * params->kp);
+        return -1;
+    }
+    return 0;
+}
+
+void runSteerLoop(struct steerClock *clk, const struct steerParams *params, int maxSamples, bool verbose, struct steerStats *stats){
+    double integral = 0.0;
+    double lastTime = 0.0;
+    double recent[STEER_JITTER_SAMPLES];
+    int inLock = 0;
+    bool backedOff = false;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->convergedAfter = -1.0;
+
+    while (keepRunning && (maxSamples == 0 || stats->samples < maxSamples)){
+        if (clk->externallySynced(clk->ctx)){
+            if (!backedOff){
+                printf("STR: system clock is synced, backing off\n");
+                backedOff = true;
+            }
+            clk->wait(clk->ctx, params->interval);
+            continue;
+        }
+        if (backedOff){
+            //Start over from whatever frequency the NTP daemon left behind.
+            printf("STR: sync lost, steering from the RTC again\n");
+            backedOff = false;
+            integral = 0.0;
+            lastTime = 0.0;
+            inLock = 0;
+            stats->convergedAfter = -1.0;
+            stats->startTime = 0.0;
+        }
+
+        double offset;
+        double uncertainty;
+        double now;
+        if (clk->measure(clk->ctx, &offset, &uncertainty, &now) != 0){
+            clk->wait(clk->ctx, params->interval);
+            continue;
+        }
+        if (stats->startTime == 0.0){
+            stats->startTime = now;
+        }
+
+        if (fabs(offset) > params->slewLimit){
+            //Far off, let the kernel slew it in and keep the integrator out of it.
+            clk->slew(clk->ctx, -offset);
+            clk->setFrequency(clk->ctx, 0.0);
+            integral = 0.0;
+            lastTime = 0.0;
+            if (verbose){
+                printf("STR: offset %+.6f s, slewing\n", offset);
+            }
+            clk->wait(clk->ctx, fabs(offset) / (params->maxPpm * 1e-6));
+            continue;
+        }
+
+        double dt = lastTime == 0.0 ? 0.0 : now - lastTime;
+        lastTime = now;
+
+        double ppm = -(params->kp * offset + params->ki * (integral + offset * dt)) * 1e6;
+        if (ppm > params->maxPpm){
+            ppm = params->maxPpm;
+        }else if (ppm < -params->maxPpm){
+            ppm = -params->maxPpm;
+        }else{
+            integral += offset * dt; //No windup while clamped
+        }
+        clk->setFrequency(clk->ctx, ppm);
+
+        recent[stats->samples % STEER_JITTER_SAMPLES] = offset;
+        stats->samples++;
+        stats->lastOffset = offset;
+        stats->freqPpm = ppm;
+
+        inLock = fabs(offset) < STEER_LOCK_WINDOW + uncertainty ? inLock + 1 : 0;
+        if (stats->convergedAfter < 0.0 && inLock >= STEER_LOCK_SAMPLES){
+            stats->convergedAfter = now - stats->startTime;
+            printf("STR: converged after %.0f s\n", stats->convergedAfter);
+        }
+        if (stats->convergedAfter >= 0.0 && stats->samples >= STEER_JITTER_SAMPLES){
+            double sum = 0.0;
+            int i;
+            for (i = 0; i < STEER_JITTER_SAMPLES; i++){
+                sum += recent[i] * recent[i];
+            }
+            stats->jitterRms = sqrt(sum / STEER_JITTER_SAMPLES);
+        }
+
+        if (verbose){
+            printf("STR: offset %+.6f s +-%.0f us, freq %+.3f ppm, jitter %.0f us\n", offset, uncertainty * 1e6, ppm, stats->jitterRms * 1e6);
+        }
+        clk->wait(clk->ctx, params->interval);
+    }
+}
+
+// Real clock: rollover measurement on the RTC, adjtimex on the system clock.
+struct realSteerCtx {
+    int fd;
+    int chip;
+    long baseFreq;          // kernel frequency when we started, scaled ppm
+    int64_t lastRollover;
+};
+
+int realSteerMeasure(void *ctx, double *offset, double *uncertainty, double *now){
+    struct realSteerCtx *real = (struct realSteerCtx *)ctx;
+    struct rtc_snapshot snap;
+    int64_t rolloverNs;
+    int64_t uncertaintyNs;
+
+    //Wake just before the next rollover instead of polling the bus for up to a second.
+    if (real->lastRollover == 0){
+        lockBus();
+        int res = findRTCRollover(real->fd, real->chip, &real->lastRollover);
+        unlockBus();
+        if (res != 0){
+            real->lastRollover = 0;
+            return -1;
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t seconds = (timespecToNs(&ts) - real->lastRollover) / 1000000000LL + 1;
+    sleepUntilNs(real->lastRollover + seconds * 1000000000LL - 5000000LL - 4 * lastReadCostNs);
+
+    lockBus();
+    int res = measureRTCRollover(real->fd, real->chip, &snap, &rolloverNs, &uncertaintyNs);
+    unlockBus();
+    if (res != 0){
+        real->lastRollover = 0;
+        return -1;
+    }
+    real->lastRollover = rolloverNs;
 
-    //Convert the times back to the appropiate format...
-    int rtcSeconds;
-    int rtcMinutes;
-    int rtcHours;
-    int rtcDay;
-    int rtcMonth;
-    int rtcYear;
-    int rtcWeekday;
+    struct timespec mono;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    *offset = (rolloverNs - snap.rtcEpoch * 1000000000LL) / 1e9;
+    *uncertainty = uncertaintyNs / 1e9;
+    *now = timespecToNs(&mono) / 1e9;
+    return 0;
+}
 
-    ones = 0;
-    tens = 0;
-    seconds %= 60;
-    ones = seconds % 10;
-    tens = ( seconds / 10 ) << 4;
-    rtcSeconds = tens | ones;
+int realSteerSetFrequency(void *ctx, double ppm){
+    struct realSteerCtx *real = (struct realSteerCtx *)ctx;
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_FREQUENCY;
+    tx.freq = real->baseFreq + (long)(ppm * 65536.0);
+    return adjtimex(&tx) < 0 ? -1 : 0;
+}
 
-    ones = 0;
-    tens = 0;
-    minutes %= 60;
-    ones = minutes % 10;
-    tens = ( minutes / 10 ) << 4;
-    rtcMinutes = tens | ones;
+int realSteerSlew(void *ctx, double offset){
+    (void)ctx;
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_OFFSET_SINGLESHOT;
+    tx.offset = (long)(offset * 1e6);
+    return adjtimex(&tx) < 0 ? -1 : 0;
+}
 
-    ones = 0;
-    tens = 0;
-    hours %= 24;
-    ones = hours % 10;
-    tens = ( hours / 10 ) << 4;
-    rtcHours = tens | ones;
+bool realSteerSynced(void *ctx){
+    struct realSteerCtx *real = (struct realSteerCtx *)ctx;
+    if (!isSystemClockSynced()){
+        return false;
+    }
 
-    ones = 0;
-    tens = 0;
-    day %= 32;
-    if (day == 0){
-        day = 1;
+    //Pick up the frequency the NTP daemon settles on, it is the best base for the next holdover.
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    if (adjtimex(&tx) != -1){
+        real->baseFreq = tx.freq;
     }
-    ones = day % 10;
-    tens = ( day / 10 ) << 4;
-    rtcDay = tens | ones;
+    return true;
+}
 
+void realSteerWait(void *ctx, double seconds){
+    (void)ctx;
+    struct timespec wait;
+    wait.tv_sec = (time_t)seconds;
+    wait.tv_nsec = (long)((seconds - (double)wait.tv_sec) * 1e9);
+    nanosleep(&wait, NULL);
+}
 
-    ones = 0;
-    tens = 0;
-    month %= 13;
-    if (month == 0){
-        month = 1;
+int runSteer(int fd, int chip, const struct steerParams *params){
+    struct realSteerCtx real;
+    struct timex tx;
+
+    memset(&tx, 0, sizeof(tx));
+    if (adjtimex(&tx) == -1){
+        printf("ERR: ADJTIMEX FAILED: %s\n", strerror(errno));
+        return 1;
     }
-    ones = month % 10;
-    tens = ( month / 10 ) << 4;
-    rtcMonth = tens | ones;
+    real.fd = fd;
+    real.chip = chip;
+    real.baseFreq = tx.freq;
+    real.lastRollover = 0;
+
+    struct steerClock clk = { &real, realSteerMeasure, realSteerSetFrequency, realSteerSlew, realSteerSynced, realSteerWait };
+    struct steerStats stats;
+
+    printf("STR: kp %.6f/s, ki %.8f/s^2, interval %.1f s, base freq %+.3f ppm\n", params->kp, params->ki, params->interval, real.baseFreq / 65536.0);
+    installStopHandlers();
+    unlockBus();
+    runSteerLoop(&clk, params, 0, true, &stats);
+    lockBus();
+
+    //A slew still in progress would keep moving the clock after we are gone.
+    realSteerSlew(&real, 0.0);
+    //Hand the clock back the way we found it, unless an NTP daemon owns it by now.
+    if (!isSystemClockSynced()){
+        realSteerSetFrequency(&real, 0.0);
+    }
+    printf("STR: %d samples, converged after %.0f s, jitter %.0f us rms\n", stats.samples, stats.convergedAfter, stats.jitterRms * 1e6);
+    return 0;
+}
 
-    ones = 0;
-    tens = 0;
-    year %= 100;
-    ones = year % 10;
-    tens = ( year / 10 ) << 4;
-    rtcYear = tens | ones;
+// Watch mode: a CLOCK_REALTIME timerfd armed with TFD_TIMER_CANCEL_ON_SET sleeps until somebody steps the
+// system clock (NTP, date, timedated), then the RTC follows within a second. Nothing runs and nothing goes on
+// the bus in between.
+const double WATCH_DEFAULT_THRESHOLD = 0.1; // seconds, for the check at startup
+
+// Expiry far in the future, only the cancel on a clock step matters.
+int armStepTimer(int tfd){
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = time(NULL) + 10L * 365 * 86400;
+    return timerfd_settime(tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
 
-    weekday %= 8;
-    if (weekday == 0){
-        weekday = 1;
+// Blocks until the clock is stepped. Returns 0 on a step, -1 when told to stop.
+int waitForClockStep(int tfd){
+    uint64_t expirations;
+    while (keepRunning){
+        if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno == ECANCELED){
+            armStepTimer(tfd);
+            return 0;
+        }
+        //Expired or interrupted, arm again and keep waiting.
+        armStepTimer(tfd);
     }
-    rtcWeekday = weekday + 1;
-
-    uint8_t rtcStatus;
+    return -1;
+}
 
-    //printf("Setting BQ32K time to: %02d:%02d:%02d %02d/%02d/%02d %02d\n", hours, minutes, seconds, day, month, year, weekday);
-    if (i2c_reg_write_byte(fd, addr, regaddr, rtcSeconds) == 0) {
-        regaddr += 1;
-        if (i2c_reg_write_byte(fd, addr, regaddr, rtcMinutes) == 0){
-            regaddr += 1;
-            if (i2c_reg_write_byte(fd, addr, regaddr, rtcHours) == 0){
-                regaddr += 1;
-                if (i2c_reg_write_byte(fd, addr, regaddr, rtcWeekday) == 0){
-                    regaddr += 1;
-                    if (i2c_reg_write_byte(fd, addr, regaddr, rtcDay) == 0){
-                        regaddr += 1;
-                        if (i2c_reg_write_byte(fd, addr, regaddr, rtcMonth) == 0){
-                            regaddr += 1;
-                            if (i2c_reg_write_byte(fd, addr, regaddr, rtcYear) == 0){
-
-                                regaddr = 0x00;
-                                if (i2c_reg_read_byte(fd, addr, regaddr, &rtcStatus) == 0){
-                                    if ((rtcStatus & 0x80) == 1){
-                                        printf("WRN: RTC Oscillator has stopped, starting...\n");
-                                        rtcStatus &= 0x7F;
-                                        if (i2c_reg_write_byte(fd, addr, regaddr, rtcStatus) == 0){
-                                            printf("SYSTOHC OK\n");
-                                            //printf("BQ32K time successfully set to: %04d-%02d-%02d %02d:%02d:%02d\n", (2000 + year), month, day, hours, minutes, seconds);
-                                        }else{
-                                            printf("BQ32K: Failed to start the RTC oscillator!\n");
-                                        }
-                                    }else{
-                                        printf("SYSTOHC OK\n");
-                                        //printf("BQ32K time successfully set to: %04d-%02d-%02d %02d:%02d:%02d\n", (2000 +year), month, day, hours, minutes, seconds);
-                                    }
-                                }else{
-                                    printf("ERR: Failed to read the 'status register' from the BQ32K chip!\n");
-                                }
-                            }else{
-                                printf("ERR: Failed to write the 'year' to the BQ32K chip!\n");
-                            }
-                        }else{
-                            printf("ERR: Failed to write the 'month' to the BQ32K chip!\n");
-                        }
-                    }else{
-                        printf("ERR: Failed to write the 'day' to the BQ32K chip!\n");
-                    }
-                }else{
-                    printf("ERR: Failed to write the 'weekday' to the BQ32K chip!\n");
-                }
-            }else{
-                printf("ERR: Failed to write the 'hours' to the BQ32K chip!\n");
+// Waits for the next full second of the system clock. A step in the meantime moves that second, so the wait starts
+// over (NTP daemons often step more than once in a row). Returns the second, 0 when told to stop.
+time_t waitForNextSecond(int tfd){
+    struct pollfd pfd;
+    pfd.fd = tfd;
+    pfd.events = POLLIN;
+
+    while (keepRunning){
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        time_t second = now.tv_sec + 1;
+
+        //poll() only does ms, the rest of the way is a plain sleep.
+        int res = poll(&pfd, 1, (int)((1000000000L - now.tv_nsec) / 1000000L));
+        if (res < 0){
+            continue;
+        }
+        if (res > 0){
+            uint64_t expirations;
+            if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno == ECANCELED){
+                printf("WCH: stepped again\n");
             }
-        }else{
-            printf("ERR: Failed to write the 'minutes' to the BQ32K chip!\n");
+            armStepTimer(tfd);
+            continue;
         }
-    } else {
-        printf("ERR: Failed to write the 'seconds' to the BQ32K chip!\n");
+        sleepUntilNs((int64_t)second * 1000000000LL);
+        return second;
     }
+    return 0;
 }
 
-void enableISL1208WRTCBit(int fd){
-    uint8_t addr = ISL1208;
-    uint8_t regaddr = 0x07; // Register to write to. (Seconds)
+// After a step the RTC is written right as the next second starts, without measuring it first, so it is fresh
+// within a second of the correction. Steps after that wake the loop again and are written the same way.
+int writeRTCAfterStep(int fd, int chip, int tfd){
+    time_t second = waitForNextSecond(tfd);
+    if (lockBus()){
+        //Somebody else had the bus, the second we waited for has gone by.
+        second = waitForNextSecond(tfd);
+    }
+    if (second == 0){
+        unlockBus();
+        return -1;
+    }
 
-    if (fd < 0){
-        printf("i2c fd error!\n");
-        return;
+    struct tm localTime;
+    localtime_r(&second, &localTime);
+    int res = writeRTCTime(fd, chip, &localTime);
+    unlockBus();
+
+    printf("WCH: RTC %s at %04d-%02d-%02d %02d:%02d:%02d\n", res == 0 ? "set" : "FAILED to set", localTime.tm_year + 1900, localTime.tm_mon + 1, localTime.tm_mday, localTime.tm_hour, localTime.tm_min, localTime.tm_sec);
+    return res;
+}
+
+// Measure the RTC against the system clock and write it on the next second boundary if it is off by threshold or
+// more. The whole second is written right as it starts, so the RTC lands within the write time of the system clock.
+int syncRTCIfOff(int fd, int chip, double threshold){
+    struct rtc_snapshot snap;
+    int64_t rolloverNs;
+    int64_t uncertaintyNs;
+    int64_t earliestNs;
+
+    lockBus();
+    int found = findRTCRollover(fd, chip, &earliestNs);
+    unlockBus();
+    if (found == 0){
+        sleepUntilNs(earliestNs + 1000000000LL - 5000000LL - 4 * lastReadCostNs);
     }
 
-    uint8_t rtcStatus;
+    lockBus();
+    if (found != 0 || measureRTCRollover(fd, chip, &snap, &rolloverNs, &uncertaintyNs) != 0){
+        unlockBus();
+        printf("WCH: RTC read failed\n");
+        return -1;
+    }
+    recordDriftSample(&snap);
 
-    if (i2c_reg_read_byte(fd, addr, regaddr, &rtcStatus) == 0) {
-        rtcStatus |= 0x10; //Set the WRTC bit.
-        if (i2c_reg_write_byte(fd, addr, regaddr, rtcStatus) == 0){
-            //printf("ISL1208 WRTC bit successfully set!\n");
-        }else{
-            printf("ERR: Failed to write the 'status register' to the ISL1208 chip!\n");
-        }
-    }else{
-        printf("ERR: Failed to read the 'status register' from the ISL1208 chip!\n");
+    double offset = (snap.rtcEpoch * 1000000000LL - rolloverNs) / 1e9;
+    if (fabs(offset) < threshold){
+        unlockBus();
+        printf("WCH: RTC off by %+.3f s (+-%.0f us), left alone\n", offset, uncertaintyNs / 1e3);
+        return 0;
     }
 
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time_t second = now.tv_sec + 1;
+    sleepUntilNs((int64_t)second * 1000000000LL);
+
+    struct tm localTime;
+    localtime_r(&second, &localTime);
+    int res = writeRTCTime(fd, chip, &localTime);
+    unlockBus();
+
+    printf("WCH: RTC off by %+.3f s (+-%.0f us), %s at %04d-%02d-%02d %02d:%02d:%02d\n", offset, uncertaintyNs / 1e3, res == 0 ? "set" : "FAILED to set", localTime.tm_year + 1900, localTime.tm_mon + 1, localTime.tm_mday, localTime.tm_hour, localTime.tm_min, localTime.tm_sec);
+    return res;
 }
 
-void setISL1208Time(int fd, int seconds, int minutes, int hours, int day, int month, int year, int weekday){
-    //According to the datasheet, I will have to write a WRTC bit on register 0x07, value 0x10 -> 0001 0000.
-    //This is to allow the RTC time setting.
- 
+int runWatchLoop(int fd, int chip, double threshold){
+    int tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+    if (tfd < 0 || armStepTimer(tfd) < 0){
+        printf("ERR: TIMERFD FAILED: %s\n", strerror(errno));
+        if (tfd >= 0){
+            close(tfd);
+        }
+        return 1;
+    }
 
-    uint8_t addr = ISL1208;
-    uint8_t regaddr = 0x00; // Register to write to. (Seconds)
+    printf("WCH: waiting for clock steps, threshold %.3f s\n", threshold);
+    installStopHandlers();
+    unlockBus();
 
-    if (fd < 0){
-        printf("i2c fd error!\n");
-        return;
+    //Catch up on anything that happened before we were started.
+    syncRTCIfOff(fd, chip, threshold);
+    while (waitForClockStep(tfd) == 0){
+        printf("WCH: system clock stepped\n");
+        writeRTCAfterStep(fd, chip, tfd);
     }
 
-    enableISL1208WRTCBit(fd);
+    lockBus();
+    close(tfd);
+    return 0;
+}
 
-    uint8_t rtcSeconds;
-    uint8_t rtcMinutes;
-    uint8_t rtcHours;
-    uint8_t rtcDay;
-    uint8_t rtcMonth;
-    uint8_t rtcYear;
-    uint8_t rtcWeekday;
+// Simulated clock for steersim: a system clock with a frequency error against an ideal RTC, read through a
+// rollover measurement with uniform noise.
+struct simSteerCtx {
+    double now;             // true time, seconds
+    double phase;           // system minus RTC, seconds
+    double naturalPpm;      // system clock frequency error
+    double correctionPpm;
+    double slewLeft;
+    double noise;           // +- seconds on each measurement
+    uint32_t rng;
+};
+
+double simRandom(struct simSteerCtx *sim){
+    sim->rng = sim->rng * 1664525u + 1013904223u;
+    return (sim->rng >> 8) / 16777216.0;
+}
 
-    rtcSeconds = intToBCD(seconds);
-    rtcMinutes = intToBCD(minutes);
+int simSteerMeasure(void *ctx, double *offset, double *uncertainty, double *now){
+    struct simSteerCtx *sim = (struct simSteerCtx *)ctx;
+    *offset = sim->phase + (simRandom(sim) * 2.0 - 1.0) * sim->noise;
+    *uncertainty = sim->noise;
+    *now = sim->now;
+    return 0;
+}
 
-    uint8_t rtcHoursBCD = intToBCD(hours); //Force 24h mode...
-    rtcHours = rtcHoursBCD | 0x80; //Set the 24h bit.
+int simSteerSetFrequency(void *ctx, double ppm){
+    ((struct simSteerCtx *)ctx)->correctionPpm = ppm;
+    return 0;
+}
 
-    rtcDay = intToBCD(day);
-    rtcMonth = intToBCD(month);
-    rtcYear = intToBCD(year - 2000);
-    rtcWeekday = intToBCD(weekday);
+int simSteerSlew(void *ctx, double offset){
+    ((struct simSteerCtx *)ctx)->slewLeft = offset;
+    return 0;
+}
 
-    if (i2c_reg_write_byte(fd, addr, regaddr, rtcSeconds) == 0) {
-        regaddr += 1;
-        if (i2c_reg_write_byte(fd, addr, regaddr, rtcMinutes) == 0){
-            regaddr += 1;
-            if (i2c_reg_write_byte(fd, addr, regaddr, rtcHours) == 0){
-                regaddr += 1;
-                if (i2c_reg_write_byte(fd, addr, regaddr, rtcDay) == 0){
-                    regaddr += 1;
-                    if (i2c_reg_write_byte(fd, addr, regaddr, rtcMonth) == 0){
-                        regaddr += 1;
-                        if (i2c_reg_write_byte(fd, addr, regaddr, rtcYear) == 0){
-                            regaddr += 1;
-                            if (i2c_reg_write_byte(fd, addr, regaddr, rtcWeekday) == 0){
-                                printf("SYSTOHC OK\n");
-                                //printf("ISL1208 time successfully set to: %04d-%02d-%02d %02d:%02d:%02d\n", year, month, day, hours, minutes, seconds);
-                            }else{
-                                printf("ERR: Failed to write the 'weekday' to the ISL1208 chip!\n");
-                            }
-                        }else{
-                            printf("ERR: Failed to write the 'year' to the ISL1208 chip!\n");
-                        }
-                    }else{
-                        printf("ERR: Failed to write the 'month' to the ISL1208 chip!\n");
-                    }
-                }else{
-                    printf("ERR: Failed to write the 'day' to the ISL1208 chip!\n");
-                }
-            }else{
-                printf("ERR: Failed to write the 'hours' to the ISL1208 chip!\n");
+bool simSteerSynced(void *ctx){
+    (void)ctx;
+    return false;
+}
+
+void simSteerWait(void *ctx, double seconds){
+    struct simSteerCtx *sim = (struct simSteerCtx *)ctx;
+    double step = 0.1;
+    double t;
+    for (t = 0.0; t < seconds; t += step){
+        double slew = 0.0;
+        if (sim->slewLeft != 0.0){
+            //The kernel slews singleshot offsets at 500 ppm.
+            slew = (sim->slewLeft > 0.0 ? 1.0 : -1.0) * 500e-6 * step;
+            if (fabs(slew) > fabs(sim->slewLeft)){
+                slew = sim->slewLeft;
             }
-        }else{
-            printf("ERR: Failed to write the 'minutes' to the ISL1208 chip!\n");
+            sim->slewLeft -= slew;
         }
-    }else{
-        printf("ERR: Failed to write the 'seconds' to the ISL1208 chip!\n");
+        sim->phase += (sim->naturalPpm + sim->correctionPpm) * 1e-6 * step + slew;
+        sim->now += step;
     }
 }
 
-void printSysTime(){
-    int sysSeconds;
-    int sysMinutes;
-    int sysHours;
-    int sysDay;
-    int sysMonth;
-    int sysYear;
-
-    //Get time system time
-    time_t currentTime;
-    time(&currentTime);
-
-    // Convert to local time format
-    struct tm *localTime = localtime(&currentTime);
-    sysSeconds = localTime->tm_sec;
-    sysMinutes = localTime->tm_min;
-    sysHours = localTime->tm_hour;
-    sysDay = localTime->tm_mday;
-    sysMonth = localTime->tm_mon + 1;
-    sysYear = localTime->tm_year + 1900;
-
-    // Print the local time
-    printf("SYS: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", sysYear, sysMonth, sysDay, sysHours, sysMinutes, sysSeconds);
+// Runs the same loop against the simulated clock and fails unless it converges and stays locked.
+int runSteerSimulation(const struct steerParams *params, double startOffset, double naturalPpm){
+    struct simSteerCtx sim;
+    memset(&sim, 0, sizeof(sim));
+    sim.now = 1.0;
+    sim.phase = startOffset;
+    sim.naturalPpm = naturalPpm;
+    sim.noise = 0.0005;
+    sim.rng = 12345;
+
+    struct steerClock clk = { &sim, simSteerMeasure, simSteerSetFrequency, simSteerSlew, simSteerSynced, simSteerWait };
+    struct steerStats stats;
+
+    printf("SIM: start offset %+.3f s, natural error %+.1f ppm, noise +-%.0f us\n", startOffset, naturalPpm, sim.noise * 1e6);
+    printf("SIM: kp %.6f/s, ki %.8f/s^2, interval %.1f s\n", params->kp, params->ki, params->interval);
+    runSteerLoop(&clk, params, 2000, false, &stats);
+
+    bool stable = stats.convergedAfter >= 0.0 && fabs(sim.phase) < STEER_LOCK_WINDOW && fabs(sim.correctionPpm + naturalPpm) < 5.0;
+    printf("SIM: converged after %.0f s, jitter %.0f us rms, final offset %+.6f s, residual freq %+.3f ppm\n", stats.convergedAfter, stats.jitterRms * 1e6, sim.phase, sim.correctionPpm + naturalPpm);
+    printf("SIM: %s\n", stable ? "STABLE" : "UNSTABLE");
+    return stable ? 0 : 1;
 }
+#endif
 
 int main(int argc, char *argv[]) {
     int chip = 0;
     int action = 0;
     int forceUnbindRebind = 0;
 
-    int rtcHours;
-    int rtcMinutes;
-    int rtcSeconds;
-    int rtcDay;
-    int rtcMonth;
-    int rtcYear;
-
-    printf("RTCSyncTool v0.7 by RuhanSA079\n");
-    rootCheck();
+    printf("RTCSyncTool v2.0 by RuhanSA079\n");
+
+#if RTC_WITH_DAEMONS
+    //The steering simulation needs neither root nor the bus: steersim [offset=S] [ppm=P] [kp=..] [ki=..] [interval=..]
+    struct steerParams steer;
+    defaultSteerParams(&steer);
+    if (argc > 1 && strcmp(argv[1], "steersim") == 0){
+        double startOffset = 0.25;
+        double naturalPpm = 40.0;
+        int i;
+        for (i = 2; i < argc; i++){
+            if (strncmp(argv[i], "offset=", 7) == 0){
+                if (parseDoubleOption(argv[i], &startOffset) != 0){
+                    return 1;
+                }
+            }else if (strncmp(argv[i], "ppm=", 4) == 0){
+                if (parseDoubleOption(argv[i], &naturalPpm) != 0){
+                    return 1;
+                }
+            }else if (isSteerOption(argv[i])){
+                if (parseSteerOption(argv[i], &steer) != 0){
+                    return 1;
+                }
+            }else{
+                printf("ERR: UNKNOWN OPTION %s\n", argv[i]);
+                return 1;
+            }
+        }
+        if (checkSteerParams(&steer) != 0){
+            return 1;
+        }
+        return runSteerSimulation(&steer, startOffset, naturalPpm);
+    }
+#endif
 
     if (argc == 1){
         printf("ERR: NO ARGS\n");
         printHelp();
         return 1;
     }
-    if (argc > 3){
+    if (argc > 8){
         printf("ERR: TOO MANY ARGS\n");
         printHelp();
         return 1;
     }
 
     //Process the action from the commandline:
-    if (strcmp(argv[1], "get") == 0){
-        action = CMD_ACTION_GET;
-        if (argc > 2){
-            if (strcmp(argv[2], "force") == 0){
-                forceUnbindRebind = 1;
-            }
-        }
-    }else if (strcmp(argv[1], "hctosys") == 0){
+    if (strcmp(argv[1], "hctosys") == 0){
         action = CMD_ACTION_HCTOSYS;
-	if (argc > 2){
-            if (strcmp(argv[2], "force") == 0){
-                forceUnbindRebind = 1;
-            }
-        }
+#if !RTC_BOOT_MINIMAL
+    }else if (strcmp(argv[1], "get") == 0){
+        action = CMD_ACTION_GET;
     }else if (strcmp(argv[1], "systohc") == 0){
         action = CMD_ACTION_SYSTOHC;
-	if (argc > 2){
-            if (strcmp(argv[2], "force") == 0){
-                forceUnbindRebind = 1;
-            }
-        }
+#endif
+#if RTC_WITH_DAEMONS
+    }else if (strcmp(argv[1], "publish") == 0){
+        action = CMD_ACTION_PUBLISH;
+    }else if (strcmp(argv[1], "refclock") == 0){
+        action = CMD_ACTION_REFCLOCK;
+    }else if (strcmp(argv[1], "steer") == 0){
+        action = CMD_ACTION_STEER;
+    }else if (strcmp(argv[1], "watch") == 0){
+        action = CMD_ACTION_WATCH;
+#endif
     }else{
         printf("ERR: UNKNOWN COMMAND\n");
         exit(1);
     }
 
-    //printf("Opening i2c bus: %s\n", argv[1]);
+    //Options after the command, in any order: force, bus=N, mux=ADDR:CHANNEL[:MODEL], unit=N, record=FILE, replay=FILE[,SCALE]
+#if RTC_WITH_DAEMONS
+    int shmUnit = 0;
+    double watchThreshold = WATCH_DEFAULT_THRESHOLD;
+#endif
+#if RTC_WITH_TRACE
+    const char *recordPath = NULL;
+#endif
+    const char *replayPath = NULL;
+    int i;
+    for (i = 2; i < argc; i++){
+        if (strncmp(argv[i], "bus=", 4) == 0){
+            char *end;
+            long bus = strtol(argv[i] + 4, &end, 10);
+            if (end == argv[i] + 4 || *end != '\0' || bus < 0 || bus > 255){
+                printf("ERR: INVALID BUS %s, USE 0 TO 255\n", argv[i] + 4);
+                return 1;
+            }
+            i2cBus = (int)bus;
+#if RTC_WITH_SYSFS_BIND
+        }else if (strcmp(argv[i], "force") == 0){
+            forceUnbindRebind = 1;
+#endif
+#if RTC_WITH_DAEMONS
+        }else if (action == CMD_ACTION_STEER && isSteerOption(argv[i])){
+            if (parseSteerOption(argv[i], &steer) != 0){
+                return 1;
+            }
+        }else if (action == CMD_ACTION_REFCLOCK && strncmp(argv[i], "unit=", 5) == 0){
+            char *end;
+            long unit = strtol(argv[i] + 5, &end, 10);
+            if (end == argv[i] + 5 || *end != '\0' || unit < 0 || unit > 255){
+                printf("ERR: INVALID SHM UNIT %s, USE 0 TO 255\n", argv[i] + 5);
+                return 1;
+            }
+            shmUnit = (int)unit;
+        }else if (action == CMD_ACTION_WATCH && strncmp(argv[i], "threshold=", 10) == 0){
+            double thresholdMs;
+            if (parseDoubleOption(argv[i], &thresholdMs) != 0){
+                return 1;
+            }
+            if (thresholdMs < 1.0 || thresholdMs > 60000.0){
+                printf("ERR: INVALID THRESHOLD %s, USE 1 TO 60000 MS\n", argv[i] + 10);
+                return 1;
+            }
+            watchThreshold = thresholdMs / 1000.0;
+#endif
+#if RTC_WITH_MUX
+        }else if (strncmp(argv[i], "mux=", 4) == 0){
+            if (parseMuxOption(argv[i] + 4) != 0){
+                return 1;
+            }
+#endif
+#if RTC_WITH_TRACE
+        }else if (strncmp(argv[i], "record=", 7) == 0){
+            recordPath = argv[i] + 7;
+        }else if (strncmp(argv[i], "replay=", 7) == 0){
+            //replay=FILE,SCALE, the scale stretches the recorded transaction times (0 = no waiting)
+            char *scale = strrchr(argv[i], ',');
+            if (scale != NULL){
+                *scale = '\0';
+                traceReplayScale = atof(scale + 1);
+            }
+            replayPath = argv[i] + 7;
+#endif
+        }else{
+            printf("ERR: UNKNOWN OPTION %s\n", argv[i]);
+            printHelp();
+            return 1;
+        }
+    }
+#if RTC_WITH_DAEMONS
+    if (action == CMD_ACTION_STEER && checkSteerParams(&steer) != 0){
+        return 1;
+    }
+#endif
+
+    int fd = -1;
+#if RTC_WITH_TRACE
+    //A replay needs no root, no bus and no lock, and leaves the system clock alone.
+    if (replayPath != NULL){
+        if (action == CMD_ACTION_STEER || action == CMD_ACTION_WATCH){
+            printf("ERR: %s CAN NOT RUN FROM A REPLAY\n", action == CMD_ACTION_STEER ? "STEER" : "WATCH");
+            return 1;
+        }
+        if (traceOpenReplay(replayPath) != 0){
+            return 1;
+        }
+        fd = open("/dev/null", O_RDWR); //Stands in for the bus, nothing is sent to it
+    }
+#endif
+    if (replayPath == NULL){
+        rootCheck();
+
+        //printf("Opening i2c bus: %s\n", argv[1]);
+
+        char busPath[32];
+        snprintf(busPath, sizeof(busPath), "/dev/i2c-%d", i2cBus);
+
+        RTC_PROBE1(bus_open_start, i2cBus);
+        int64_t openStart = RTC_PROBE_ENABLED(bus_open_done) ? probeClockNs() : 0;
+        fd = open(busPath, O_RDWR);
+        RTC_PROBE3(bus_open_done, i2cBus, fd < 0 ? errno : 0, RTC_PROBE_ENABLED(bus_open_done) ? probeClockNs() - openStart : 0);
+        if (fd < 0) {
+            printf("ERR: FAILED TO OPEN I2C BUS\n");
+            exit(1);
+        }
+
+        if (negotiateI2CAdapter(fd) != 0){
+            close(fd);
+            exit(1);
+        }
+        openBusLock();
+    }
 
-    int fd;
-    fd = open("/dev/i2c-0", O_RDWR);
-    if (fd < 0) {
-        printf("ERR: FAILED TO OPEN I2C BUS\n");
+    //Released when we exit, even on the error paths.
+    struct timespec waitStart;
+    clock_gettime(CLOCK_REALTIME, &waitStart);
+#if RTC_BOOT_MINIMAL
+    lockBus();
+#else
+    bool waitedForBus = lockBus();
+#endif
+#if RTC_WITH_DAEMONS
+    if (waitedForBus && action == CMD_ACTION_GET && useSharedSnapshot(&waitStart)){
+        close(fd);
+        return 0;
+    }
+#endif
+
+    if (replayPath == NULL && muxInit(fd) != 0){
+        close(fd);
+        exit(1);
+    }
+
+#if RTC_WITH_TRACE
+    if (recordPath != NULL && replayPath == NULL && traceOpenRecord(recordPath) != 0){
+        muxRestore(fd);
+        close(fd);
         exit(1);
     }
+#endif
 
     //printf("i2c bus now open, probing i2c bus for BQ32K and ISL1208...\n");
 
-    //ISL1208
-    int ret = probeI2CDevice(fd, ISL1208, forceUnbindRebind);
-    if (ret == 0){
+#if RTC_WITH_ISL1208
+    if (probeRTC(fd, ISL1208, forceUnbindRebind) == 0){
         chip = ISL1208;
     }
+#endif
 
-    //BQ32K
-    ret = probeI2CDevice(fd, BQ32K, forceUnbindRebind);
-    if (ret == 0){
+#if RTC_WITH_BQ32K
+    if (probeRTC(fd, BQ32K, forceUnbindRebind) == 0){
         chip = BQ32K;
     }
+#endif
 
 
     if (chip == BQ32K || chip == ISL1208){
         //printf("RTC found, reading data...\n");
-        if (action == CMD_ACTION_GET){
-            printSysTime();
-
-            if (chip == ISL1208){
-                readISL1208(fd, true, false);
-            }
-
-            if (chip == BQ32K){
-                readBQ32K(fd, true, false);
-            }
-        }else if (action == CMD_ACTION_HCTOSYS){
+        if (action == CMD_ACTION_HCTOSYS){
             printSysTime();
             //Set the system date from the RTC...
-            if (chip == ISL1208){
-                readISL1208(fd, true, true);
-            }
+            readRTC(fd, chip, true, true, NULL);
+#if !RTC_BOOT_MINIMAL
+        }else if (action == CMD_ACTION_GET){
+            printSysTime();
 
-            if (chip == BQ32K){
-                readBQ32K(fd, true, true);
+            struct rtc_snapshot snap;
+            if (readRTC(fd, chip, true, false, &snap) == 0){
+                recordDriftSample(&snap);
+
+#if RTC_WITH_DAEMONS
+                //Leave the result for any get that queued up behind us.
+                storeBusResult(&snap);
+#endif
             }
         }else if (action == CMD_ACTION_SYSTOHC){
             //hwclock output: 2019-09-20 11:08:05.566357+00:00
 
-            int sysSeconds;
-            int sysMinutes;
-            int sysHours;
-            int sysDay;
-            int sysMonth;
-            int sysYear;
-            int sysWeekday;
-
-
             //Get time system time
             time_t currentTime;
             time(&currentTime);
 
             // Convert to local time format
-            struct tm *localTime = localtime(&currentTime);
-            sysSeconds = localTime->tm_sec;
-            sysMinutes = localTime->tm_min;
-            sysHours = localTime->tm_hour;
-            sysDay = localTime->tm_mday;
-            sysMonth = localTime->tm_mon + 1;
-            sysYear = localTime->tm_year + 1900;
-
-            sysWeekday = calculateDayOfWeek(sysDay, sysMonth, sysYear);
+            struct tm localTime;
+            localtime_r(&currentTime, &localTime);
 
             // Print the local time
-            printf("SYS: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", sysYear, sysMonth, sysDay, sysHours, sysMinutes, sysSeconds);
+            printf("SYS: %04d-%02d-%02d %02d:%02d:%02d.000000+00:00\n", localTime.tm_year + 1900, localTime.tm_mon + 1, localTime.tm_mday, localTime.tm_hour, localTime.tm_min, localTime.tm_sec);
 
             //Set the RTC from the system time/
-            if (chip == ISL1208){
-                readISL1208(fd, true, false);
-                setISL1208Time(fd, sysSeconds, sysMinutes, sysHours, sysDay, sysMonth, sysYear, sysWeekday);
-            }
-
-            if (chip == BQ32K){
-                readBQ32K(fd, true, false);
-                setBQ32KTime(fd, sysSeconds, sysMinutes, sysHours, sysDay, sysMonth, sysYear, sysWeekday);
+            struct rtc_snapshot snap;
+            if (readRTCShared(fd, chip, waitedForBus, &waitStart, &snap) == 0){
+                recordDriftSample(&snap);
             }
+            writeRTCTime(fd, chip, &localTime);
+#endif
+#if RTC_WITH_DAEMONS
+        }else if (action == CMD_ACTION_PUBLISH){
+            runPublishLoop(fd, chip);
+        }else if (action == CMD_ACTION_REFCLOCK){
+            runRefclockLoop(fd, chip, shmUnit);
+        }else if (action == CMD_ACTION_STEER){
+            runSteer(fd, chip, &steer);
+        }else if (action == CMD_ACTION_WATCH){
+            runWatchLoop(fd, chip, watchThreshold);
+#endif
         }
 
-
-        if (forceUnbindRebind == 1){
-            //printf("Rebinding driver...\n");
-            rebindDevices(chip);
+        if (action != CMD_ACTION_PUBLISH && action != CMD_ACTION_REFCLOCK && action != CMD_ACTION_STEER && action != CMD_ACTION_WATCH){
+            printBusReport();
         }
+
     } else {
         printf("ERR: FAILED TO DETECT/READ RTC\n");
+        muxRestore(fd);
         close(fd);
+#if RTC_WITH_SYSFS_BIND
+        //force may have unbound the driver before the probe failed, it still goes back.
+        rebindDevicesDeferred();
+#endif
+#if RTC_WITH_TRACE
+        traceClose();
+#endif
         return 1;
     }
 
+    muxRestore(fd);
     close(fd);
+#if RTC_WITH_SYSFS_BIND
+    //After the mux is back where the driver expects it.
+    rebindDevicesDeferred();
+#endif
+#if RTC_WITH_TRACE
+    return traceClose();
+#else
     return 0;
+#endif
 }